@@ -0,0 +1,50 @@
+/**
+ * blocked_scan.cpp
+ */
+
+#include "blocked_scan.h"
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+using std::vector;
+
+void nearestLandmarksBlocked(const LandmarkColumns &landmarks,
+                             const double *qx, const double *qy, size_t n,
+                             int *nearest, int query_tile, int landmark_tile) {
+  size_t num_landmarks = landmarks.size();
+  const float *lx = landmarks.x.data(), *ly = landmarks.y.data();
+
+  vector<float> tx(n), ty(n), best_dist(n, std::numeric_limits<float>::infinity());
+  for (size_t i = 0; i < n; ++i) {
+    tx[i] = static_cast<float>(qx[i]);
+    ty[i] = static_cast<float>(qy[i]);
+    nearest[i] = -1;
+  }
+
+  // Each landmark tile is reused by every query tile, and each query tile
+  //   stays in L1 while the landmarks of the tile go past it
+  size_t q_tile = std::max(query_tile, 1);
+  size_t l_tile = std::max(landmark_tile, 1);
+  for (size_t l0 = 0; l0 < num_landmarks; l0 += l_tile) {
+    size_t l_end = std::min(l0 + l_tile, num_landmarks);
+    for (size_t q0 = 0; q0 < n; q0 += q_tile) {
+      size_t q_end = std::min(q0 + q_tile, n);
+      for (size_t j = l0; j < l_end; ++j) {
+        float x = lx[j], y = ly[j];
+        int id = static_cast<int>(j);
+        for (size_t i = q0; i < q_end; ++i) {
+          float dx = tx[i] - x;
+          float dy = ty[i] - y;
+          float d = dx * dx + dy * dy;
+          // Select the ID through a mask, a branch-free form the
+          //   vectorizer accepts
+          int closer = -static_cast<int>(d < best_dist[i]);
+          best_dist[i] = d < best_dist[i] ? d : best_dist[i];
+          nearest[i] = (id & closer) | (nearest[i] & ~closer);
+        }
+      }
+    }
+  }
+}
@@ -0,0 +1,67 @@
+/**
+ * blocked_scan.h
+ * Cache-blocked brute-force nearest-landmark search for many points.
+ *
+ * A plain scan sweeps the whole landmark list for every query, so once
+ *   the list outgrows L1 each query streams it from L2 or memory again.
+ *   The blocked scan takes the landmarks as coordinate arrays, built
+ *   once and reused by every scan, copies the queries the same way and
+ *   walks every tile of queries against one tile of landmarks at a time,
+ *   keeping a running minimum for every query. The innermost loop runs
+ *   over the queries of a tile, whose minima are independent, so the
+ *   compiler can vectorize it.
+ */
+
+#ifndef BLOCKED_SCAN_H_
+#define BLOCKED_SCAN_H_
+
+#include <stddef.h>
+#include <vector>
+#include "map.h"
+
+// Default tile sizes: 16 KB of query state, 8 KB of landmarks
+const int kScanQueryTile = 1024;
+const int kScanLandmarkTile = 1024;
+
+/**
+ * Struct holding the landmark coordinates as the float columns the scan
+ *   reads.
+ */
+struct LandmarkColumns {
+  std::vector<float> x;
+  std::vector<float> y;
+
+  /**
+   * assign Copies the positions of a landmark list, reusing the storage.
+   * @param (dx,dy) Offset added to every position, such as from the map
+   *   origin to the local origin of the queries [m]
+   */
+  void assign(const std::vector<Map::single_landmark_s> &landmarks,
+              double dx = 0, double dy = 0) {
+    x.resize(landmarks.size());
+    y.resize(landmarks.size());
+    for (size_t j = 0; j < landmarks.size(); ++j) {
+      x[j] = static_cast<float>(landmarks[j].x_f + dx);
+      y[j] = static_cast<float>(landmarks[j].y_f + dy);
+    }
+  }
+
+  size_t size() const {
+    return x.size();
+  }
+};
+
+/**
+ * nearestLandmarksBlocked Finds the closest landmark of each query point.
+ * @param landmarks Columns of the landmarks to search
+ * @param (qx,qy) Query points in map coordinates [m], n of each
+ * @param nearest Receives the position in landmarks of the closest
+ *   landmark of each query, -1 if there are no landmarks
+ * @param query_tile, landmark_tile Tile sizes of the scan
+ */
+void nearestLandmarksBlocked(const LandmarkColumns &landmarks,
+                             const double *qx, const double *qy, size_t n,
+                             int *nearest, int query_tile = kScanQueryTile,
+                             int landmark_tile = kScanLandmarkTile);
+
+#endif  // BLOCKED_SCAN_H_
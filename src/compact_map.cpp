@@ -0,0 +1,135 @@
+/**
+ * compact_map.cpp
+ */
+
+#include "compact_map.h"
+
+#include <math.h>
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+using std::vector;
+
+void CompactMap::build(const vector<double> &x, const vector<double> &y,
+                       const vector<int> &id, double tile_size) {
+  size_t n = x.size();
+  this->tile_size = tile_size;
+  quantum = tile_size / 65536;
+  tile_start.clear();
+  coords.clear();
+  ids.clear();
+  tiles_x = tiles_y = 0;
+  if (n == 0) {
+    return;
+  }
+
+  min_x = *std::min_element(x.begin(), x.end());
+  min_y = *std::min_element(y.begin(), y.end());
+
+  // Quantize once on the global grid: the high bits select the tile and
+  //   the low 16 bits are the offset in it, so no offset needs clamping
+  vector<int64_t> qx(n), qy(n);
+  int64_t max_qx = 0, max_qy = 0;
+  for (size_t i = 0; i < n; ++i) {
+    qx[i] = llround((x[i] - min_x) / quantum);
+    qy[i] = llround((y[i] - min_y) / quantum);
+    max_qx = std::max(max_qx, qx[i]);
+    max_qy = std::max(max_qy, qy[i]);
+  }
+  tiles_x = static_cast<int>(max_qx >> 16) + 1;
+  tiles_y = static_cast<int>(max_qy >> 16) + 1;
+
+  // Counting sort of the landmarks by tile
+  vector<int> tile_of(n);
+  tile_start.assign(static_cast<size_t>(tiles_x) * tiles_y + 1, 0);
+  for (size_t i = 0; i < n; ++i) {
+    tile_of[i] = static_cast<int>((qy[i] >> 16) * tiles_x + (qx[i] >> 16));
+    ++tile_start[tile_of[i] + 1];
+  }
+  for (size_t t = 1; t < tile_start.size(); ++t) {
+    tile_start[t] += tile_start[t - 1];
+  }
+
+  vector<uint32_t> fill(tile_start.begin(), tile_start.end() - 1);
+  coords.resize(n);
+  ids.resize(n);
+  for (size_t i = 0; i < n; ++i) {
+    uint32_t at = fill[tile_of[i]]++;
+    coords[at].x = static_cast<uint16_t>(qx[i] & 0xffff);
+    coords[at].y = static_cast<uint16_t>(qy[i] & 0xffff);
+    ids[at] = id[i];
+  }
+}
+
+void CompactMap::position(int i, double &x, double &y) const {
+  int t = static_cast<int>(std::upper_bound(tile_start.begin(), tile_start.end(),
+                                            static_cast<uint32_t>(i))
+                           - tile_start.begin()) - 1;
+  x = min_x + (t % tiles_x) * tile_size + coords[i].x * quantum;
+  y = min_y + (t / tiles_x) * tile_size + coords[i].y * quantum;
+}
+
+void CompactMap::searchTile(int tile, double x, double y, int &best,
+                            float &best_dist) const {
+  // Query position relative to the tile corner, in quanta
+  float ox = static_cast<float>((x - min_x - (tile % tiles_x) * tile_size) / quantum);
+  float oy = static_cast<float>((y - min_y - (tile / tiles_x) * tile_size) / quantum);
+  for (uint32_t i = tile_start[tile], end = tile_start[tile + 1]; i < end; ++i) {
+    float dx = coords[i].x - ox;
+    float dy = coords[i].y - oy;
+    float d = dx * dx + dy * dy;
+    if (d < best_dist) {
+      best_dist = d;
+      best = static_cast<int>(i);
+    }
+  }
+}
+
+int CompactMap::nearest(double x, double y) const {
+  if (coords.empty()) {
+    return -1;
+  }
+
+  // Cell of the query on the (unbounded) tile grid, and its distance to
+  //   the closest cell edge
+  double fx = (x - min_x) / tile_size;
+  double fy = (y - min_y) / tile_size;
+  int tx = static_cast<int>(floor(fx));
+  int ty = static_cast<int>(floor(fy));
+  fx -= tx;
+  fy -= ty;
+  double edge = std::min(std::min(fx, 1 - fx), std::min(fy, 1 - fy)) * tile_size;
+
+  int best = -1;
+  float best_dist = std::numeric_limits<float>::infinity();
+  for (int r = 0; ; ++r) {
+    // Visit the tiles of ring r around the query cell
+    for (int cy = ty - r; cy <= ty + r; ++cy) {
+      if (cy < 0 || cy >= tiles_y) {
+        continue;
+      }
+      int step = (cy == ty - r || cy == ty + r) ? 1 : 2 * r;
+      for (int cx = tx - r; cx <= tx + r; cx += std::max(step, 1)) {
+        if (cx >= 0 && cx < tiles_x) {
+          searchTile(cy * tiles_x + cx, x, y, best, best_dist);
+        }
+      }
+    }
+
+    // Tiles further out are at least r + 1 rings away
+    double reach = (r * tile_size + edge) / quantum;
+    if (best >= 0 && best_dist <= reach * reach) {
+      break;
+    }
+    if (tx - r <= 0 && ty - r <= 0 && tx + r >= tiles_x - 1 && ty + r >= tiles_y - 1) {
+      break;
+    }
+  }
+  return best;
+}
+
+size_t CompactMap::memoryBytes() const {
+  return tile_start.capacity() * sizeof(uint32_t) + coords.capacity() * sizeof(Offset)
+         + ids.capacity() * sizeof(int);
+}
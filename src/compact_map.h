@@ -0,0 +1,98 @@
+/**
+ * compact_map.h
+ * Quantized, tile-relative landmark storage.
+ *
+ * The map area is cut into square tiles on a regular grid. Landmarks are
+ *   grouped by tile and store their position as two 16-bit offsets from
+ *   the tile corner, so a landmark costs 4 bytes of coordinates instead of
+ *   two floats plus an ID. Tile corners are derived in double precision
+ *   from the grid origin, and IDs live in a separate array that the
+ *   association never touches.
+ *
+ * Precision: a coordinate is off by at most half a quantum, with
+ *   quantum = tile_size / 65536 (3.9 mm for the default 256 m tiles).
+ */
+
+#ifndef COMPACT_MAP_H_
+#define COMPACT_MAP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+class CompactMap {
+ public:
+  CompactMap() : tile_size(0), quantum(0), min_x(0), min_y(0),
+                 tiles_x(0), tiles_y(0) {}
+
+  /**
+   * build Encodes a set of landmarks.
+   * @param x, y, id Landmark positions [m] and IDs, all of the same size
+   * @param tile_size Edge of a tile [m]
+   */
+  void build(const std::vector<double> &x, const std::vector<double> &y,
+             const std::vector<int> &id, double tile_size = 256);
+
+  /**
+   * nearest Finds the landmark closest to a point, decoding positions on
+   *   the fly.
+   * @param (x,y) Query point in map coordinates [m]
+   * @output Landmark position in the compact order, -1 if empty
+   */
+  int nearest(double x, double y) const;
+
+  /**
+   * position Decodes the position of a landmark.
+   * @param i Landmark position in the compact order
+   */
+  void position(int i, double &x, double &y) const;
+
+  /**
+   * id Returns the ID of a landmark.
+   */
+  int id(int i) const {
+    return ids[i];
+  }
+
+  size_t size() const {
+    return coords.size();
+  }
+
+  bool empty() const {
+    return coords.empty();
+  }
+
+  /**
+   * maxError Returns the largest per-axis encoding error [m].
+   */
+  double maxError() const {
+    return quantum / 2;
+  }
+
+  /**
+   * memoryBytes Returns the heap memory used by the encoding.
+   */
+  size_t memoryBytes() const;
+
+ private:
+  struct Offset {
+    uint16_t x;  // Offset from the tile corner, in quanta
+    uint16_t y;
+  };
+
+  // Scans one tile for a landmark closer than best_dist
+  void searchTile(int tile, double x, double y, int &best, float &best_dist) const;
+
+  double tile_size;  // Edge of a tile [m]
+  double quantum;    // Size of one coordinate step [m]
+  double min_x;      // Corner of tile 0 [m]
+  double min_y;
+  int tiles_x;       // Grid size in tiles
+  int tiles_y;
+
+  std::vector<uint32_t> tile_start;  // First landmark of each tile, plus end
+  std::vector<Offset> coords;        // Landmark offsets, grouped by tile
+  std::vector<int> ids;              // Landmark IDs, in the same order
+};
+
+#endif  // COMPACT_MAP_H_
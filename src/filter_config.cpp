@@ -0,0 +1,323 @@
+/**
+ * filter_config.cpp
+ */
+
+#include "filter_config.h"
+
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "helper_functions.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+
+// Largest raster the tuner builds, 64 MB of cells
+const double kMaxTuneRasterCells = 1 << 24;
+
+// Filter steps timed per candidate, and the best of how many runs counts
+const int kTuneSteps = 20;
+const int kTuneRuns = 3;
+
+// Relative gain a candidate needs over the current setting to replace it,
+//   so that timing noise does not flip parameters
+const double kTuneMinGain = 0.03;
+
+const char *kUpdateOrderNames[] = {"auto", "particle", "observation"};
+const char *kAssociationNames[] = {"index", "raster", "scan"};
+const char *kResamplerNames[] = {"wheel", "systematic"};
+
+// Position of name in names, -1 if absent
+int findName(const char *const names[], int count, const string &name) {
+  for (int i = 0; i < count; ++i) {
+    if (name == names[i]) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Synthetic filter step: a vehicle standing in the middle of the
+//   landmarks, observing those within sensor range; (x, y) is relative
+//   to the map origin
+struct TuneScenario {
+  double x, y;
+  double sensor_range;
+  vector<LandmarkObs> observations;
+};
+
+TuneScenario makeScenario(const Map &map) {
+  TuneScenario scenario;
+  scenario.sensor_range = 50;
+  const vector<Map::single_landmark_s> &landmarks = map.landmark_list;
+  float min_x = landmarks[0].x_f, max_x = min_x;
+  float min_y = landmarks[0].y_f, max_y = min_y;
+  for (size_t i = 1; i < landmarks.size(); ++i) {
+    min_x = std::min(min_x, landmarks[i].x_f);
+    max_x = std::max(max_x, landmarks[i].x_f);
+    min_y = std::min(min_y, landmarks[i].y_f);
+    max_y = std::max(max_y, landmarks[i].y_f);
+  }
+  scenario.x = 0.5 * (min_x + max_x);
+  scenario.y = 0.5 * (min_y + max_y);
+
+  // Observe the landmarks in range, or the closest few on a sparse map
+  vector<std::pair<double, int> > nearby;
+  for (size_t i = 0; i < landmarks.size(); ++i) {
+    double d = dist(landmarks[i].x_f, landmarks[i].y_f, scenario.x, scenario.y);
+    nearby.push_back(std::make_pair(d, static_cast<int>(i)));
+  }
+  std::sort(nearby.begin(), nearby.end());
+  std::mt19937 gen(1);
+  std::normal_distribution<double> noise(0, 0.1);
+  for (size_t i = 0; i < nearby.size(); ++i) {
+    if (nearby[i].first > scenario.sensor_range && scenario.observations.size() >= 5) {
+      break;
+    }
+    const Map::single_landmark_s &landmark = landmarks[nearby[i].second];
+    LandmarkObs obs = {0, 0, 0, 0};
+    obs.x = landmark.x_f - scenario.x + noise(gen);
+    obs.y = landmark.y_f - scenario.y + noise(gen);
+    scenario.observations.push_back(obs);
+  }
+  return scenario;
+}
+
+// Seconds per predict-update-resample step of a filter under config
+double timeStep(const FilterConfig &config, const Map &map,
+                const TuneScenario &scenario, int num_particles) {
+  double sigma_pos[3] = {0.3, 0.3, 0.01};
+  double sigma_landmark[2] = {0.3, 0.3};
+  double best = 0;
+  for (int run = 0; run < kTuneRuns; ++run) {
+    ParticleFilter pf(num_particles);
+    applyConfig(config, pf);
+    pf.init(map.origin_x + scenario.x, map.origin_y + scenario.y, 0, sigma_pos);
+
+    // The first step sizes the buffers
+    pf.updateWeights(scenario.sensor_range, sigma_landmark, scenario.observations, map);
+    pf.resample();
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int step = 0; step < kTuneSteps; ++step) {
+      pf.prediction(0.1, sigma_pos, 0, 0);
+      pf.updateWeights(scenario.sensor_range, sigma_landmark, scenario.observations, map);
+      pf.resample();
+    }
+    double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count() / kTuneSteps;
+    if (run == 0 || seconds < best) {
+      best = seconds;
+    }
+  }
+  return best;
+}
+
+}  // namespace
+
+bool saveConfig(const FilterConfig &config, const string &filename) {
+  std::ofstream out(filename.c_str(), std::ofstream::trunc);
+  out << "threads " << config.threads << "\n"
+      << "chunk_size " << config.chunk_size << "\n"
+      << "update_order " << kUpdateOrderNames[config.update_order] << "\n"
+      << "association " << kAssociationNames[config.association] << "\n"
+      << "raster_resolution " << config.raster_resolution << "\n"
+      << "resampler " << kResamplerNames[config.resampler] << "\n"
+      << "spatial_sort " << (config.spatial_sort ? 1 : 0) << "\n";
+  out.close();
+  return !out.fail();
+}
+
+bool loadConfig(const string &filename, FilterConfig &config) {
+  std::ifstream in(filename.c_str());
+  if (!in) {
+    return false;
+  }
+
+  FilterConfig loaded = config;
+  string line;
+  while (getline(in, line)) {
+    std::istringstream iss_line(line);
+    string key, value;
+    if (!(iss_line >> key)) {
+      continue;
+    }
+    if (!(iss_line >> value)) {
+      return false;
+    }
+
+    std::istringstream iss_value(value);
+    bool ok = true;
+    if (key == "threads") {
+      ok = static_cast<bool>(iss_value >> loaded.threads) && loaded.threads > 0;
+    } else if (key == "chunk_size") {
+      ok = static_cast<bool>(iss_value >> loaded.chunk_size);
+    } else if (key == "update_order") {
+      int i = findName(kUpdateOrderNames, 3, value);
+      loaded.update_order = static_cast<ParticleFilter::UpdateOrder>(i);
+      ok = i >= 0;
+    } else if (key == "association") {
+      int i = findName(kAssociationNames, 3, value);
+      loaded.association = static_cast<FilterConfig::Association>(i);
+      ok = i >= 0;
+    } else if (key == "raster_resolution") {
+      ok = static_cast<bool>(iss_value >> loaded.raster_resolution)
+           && loaded.raster_resolution > 0;
+    } else if (key == "resampler") {
+      int i = findName(kResamplerNames, 2, value);
+      loaded.resampler = static_cast<ParticleFilter::Resampler>(i);
+      ok = i >= 0;
+    } else if (key == "spatial_sort") {
+      ok = static_cast<bool>(iss_value >> loaded.spatial_sort);
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+  config = loaded;
+  return true;
+}
+
+void applyConfig(const FilterConfig &config, ParticleFilter &pf) {
+  pf.setThreads(config.threads, config.chunk_size);
+  pf.setUpdateOrder(config.update_order);
+  pf.setResampler(config.resampler);
+  pf.setSpatialSort(config.spatial_sort);
+}
+
+void applyConfig(const FilterConfig &config, MapStore &maps) {
+  maps.setLayout(config.association != FilterConfig::kAssociateScan,
+                 config.association == FilterConfig::kAssociateRaster
+                 ? config.raster_resolution : 0);
+}
+
+FilterConfig autotune(const Map &map, int num_particles, std::ostream *log) {
+  FilterConfig best;
+  if (map.landmark_list.empty()) {
+    return best;
+  }
+  TuneScenario scenario = makeScenario(map);
+
+  // The map under each association, the raster only if it fits the budget
+  Map maps[3];
+  maps[FilterConfig::kAssociateScan].landmark_list = map.landmark_list;
+  maps[FilterConfig::kAssociateScan].origin_x = map.origin_x;
+  maps[FilterConfig::kAssociateScan].origin_y = map.origin_y;
+  maps[FilterConfig::kAssociateIndex] = maps[FilterConfig::kAssociateScan];
+  maps[FilterConfig::kAssociateIndex].buildIndex(
+      std::max(1u, std::thread::hardware_concurrency()));
+  bool raster = false;
+  {
+    const vector<Map::single_landmark_s> &landmarks = map.landmark_list;
+    float min_x = landmarks[0].x_f, max_x = min_x;
+    float min_y = landmarks[0].y_f, max_y = min_y;
+    for (size_t i = 1; i < landmarks.size(); ++i) {
+      min_x = std::min(min_x, landmarks[i].x_f);
+      max_x = std::max(max_x, landmarks[i].x_f);
+      min_y = std::min(min_y, landmarks[i].y_f);
+      max_y = std::max(max_y, landmarks[i].y_f);
+    }
+    double cells = (max_x - min_x + 100) * (max_y - min_y + 100)
+                   / (best.raster_resolution * best.raster_resolution);
+    if (cells <= kMaxTuneRasterCells) {
+      maps[FilterConfig::kAssociateRaster] = maps[FilterConfig::kAssociateIndex];
+      maps[FilterConfig::kAssociateRaster].buildRaster(best.raster_resolution);
+      raster = true;
+    }
+  }
+
+  // Candidate settings of each parameter
+  vector<FilterConfig::Association> associations;
+  associations.push_back(FilterConfig::kAssociateIndex);
+  associations.push_back(FilterConfig::kAssociateScan);
+  if (raster) {
+    associations.push_back(FilterConfig::kAssociateRaster);
+  }
+  vector<std::pair<int, size_t> > spreads(1, std::make_pair(1, 0));
+  int cores = static_cast<int>(std::thread::hardware_concurrency());
+  for (int threads = 2; threads <= cores; threads *= 2) {
+    const size_t chunk_sizes[] = {64, 256, 1024};
+    for (size_t chunk_size : chunk_sizes) {
+      if (chunk_size < static_cast<size_t>(num_particles)) {
+        spreads.push_back(std::make_pair(threads, chunk_size));
+      }
+    }
+  }
+
+  double best_time = timeStep(best, maps[best.association], scenario, num_particles);
+  if (log) {
+    *log << "baseline: " << best_time * 1e6 << " us/step" << std::endl;
+  }
+
+  // Coordinate descent: tune one parameter at a time, keeping a candidate
+  //   only if it beats the current setting by a margin
+  bool changed = true;
+  for (int round = 0; changed && round < 3; ++round) {
+    changed = false;
+    for (int parameter = 0; parameter < 5; ++parameter) {
+      size_t count = parameter == 0 ? associations.size()
+                     : parameter == 1 ? 3
+                     : parameter == 2 ? spreads.size()
+                     : 2;
+      for (size_t k = 0; k < count; ++k) {
+        FilterConfig candidate = best;
+        std::ostringstream name;
+        switch (parameter) {
+          case 0:
+            candidate.association = associations[k];
+            name << "association " << kAssociationNames[candidate.association];
+            break;
+          case 1:
+            candidate.update_order = static_cast<ParticleFilter::UpdateOrder>(k);
+            name << "update_order " << kUpdateOrderNames[candidate.update_order];
+            break;
+          case 2:
+            candidate.threads = spreads[k].first;
+            candidate.chunk_size = spreads[k].second;
+            name << "threads " << candidate.threads << " chunk_size " << candidate.chunk_size;
+            break;
+          case 3:
+            candidate.resampler = static_cast<ParticleFilter::Resampler>(k);
+            name << "resampler " << kResamplerNames[candidate.resampler];
+            break;
+          case 4:
+            candidate.spatial_sort = k == 1;
+            name << "spatial_sort " << k;
+            break;
+        }
+        if (candidate.association == best.association
+            && candidate.update_order == best.update_order
+            && candidate.threads == best.threads
+            && candidate.chunk_size == best.chunk_size
+            && candidate.resampler == best.resampler
+            && candidate.spatial_sort == best.spatial_sort) {
+          continue;
+        }
+        double seconds = timeStep(candidate, maps[candidate.association], scenario,
+                                  num_particles);
+        if (log) {
+          *log << name.str() << ": " << seconds * 1e6 << " us/step" << std::endl;
+        }
+        if (seconds < best_time * (1 - kTuneMinGain)) {
+          best = candidate;
+          best_time = seconds;
+          changed = true;
+        }
+      }
+    }
+  }
+  if (log) {
+    *log << "tuned: " << best_time * 1e6 << " us/step" << std::endl;
+  }
+  return best;
+}
@@ -0,0 +1,87 @@
+/**
+ * filter_config.h
+ * Execution parameters of the filter, their profile files and a tuner
+ *   that picks them for the host.
+ *
+ * The fastest settings depend on the machine as much as on the map: the
+ *   cache sizes decide between the index, the raster and the blocked scan,
+ *   the vector width between the two update orders, and the core count
+ *   how to spread the particles over threads. autotune times short
+ *   synthetic runs of the filter on the actual map and keeps the fastest
+ *   setting of one parameter at a time. The result is saved as a profile,
+ *   so that later runs on the same host load it instead of tuning again.
+ */
+
+#ifndef FILTER_CONFIG_H_
+#define FILTER_CONFIG_H_
+
+#include <stddef.h>
+#include <iostream>
+#include <string>
+#include "map.h"
+#include "map_store.h"
+#include "particle_filter.h"
+
+/**
+ * Struct holding the execution parameters of the filter. None of them
+ *   changes the estimates beyond the random draws.
+ */
+struct FilterConfig {
+  // Structure the observations are associated through
+  enum Association {
+    kAssociateIndex,   // k-d tree index
+    kAssociateRaster,  // Nearest-landmark raster over the index
+    kAssociateScan     // Cache-blocked scan of all landmarks, no index
+  };
+
+  int threads;                             // Threads weighing particles
+  size_t chunk_size;                       // Particles per chunk, 0 for one
+  ParticleFilter::UpdateOrder update_order;
+  Association association;
+  double raster_resolution;                // Raster cell edge [m]
+  ParticleFilter::Resampler resampler;
+  bool spatial_sort;                       // Morton order after resample
+
+  FilterConfig()
+      : threads(1), chunk_size(0),
+        update_order(ParticleFilter::kUpdateOrderAuto),
+        association(kAssociateIndex), raster_resolution(0.5),
+        resampler(ParticleFilter::kResampleWheel), spatial_sort(false) {}
+};
+
+/**
+ * saveConfig Writes a profile, one "key value" line per parameter.
+ * @output True if the file was written
+ */
+bool saveConfig(const FilterConfig &config, const std::string &filename);
+
+/**
+ * loadConfig Reads a profile written by saveConfig. Parameters missing
+ *   from the file keep their value in config.
+ * @output False if the file is missing or holds an unknown key or value;
+ *   config is then left unchanged
+ */
+bool loadConfig(const std::string &filename, FilterConfig &config);
+
+/**
+ * applyConfig Sets the execution parameters of a filter.
+ */
+void applyConfig(const FilterConfig &config, ParticleFilter &pf);
+
+/**
+ * applyConfig Sets how the maps loaded from now on are prepared for
+ *   association.
+ */
+void applyConfig(const FilterConfig &config, MapStore &maps);
+
+/**
+ * autotune Times filter steps on a map under different parameters and
+ *   returns the fastest ones found. Each parameter is tuned in turn with
+ *   the others fixed, until a full round changes none of them.
+ * @param map Map to tune on, with or without its index
+ * @param num_particles Number of particles of the filter
+ * @param log Receives the time of every candidate, or null
+ */
+FilterConfig autotune(const Map &map, int num_particles, std::ostream *log);
+
+#endif  // FILTER_CONFIG_H_
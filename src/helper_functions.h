@@ -29,6 +29,15 @@ struct control_s {
   double yawrate;   // Yaw rate [rad/s]
 };
 
+/**
+ * Struct representing one control input together with its duration.
+ */
+struct control_step_s {
+  double velocity;  // Velocity [m/s]
+  double yawrate;   // Yaw rate [rad/s]
+  double delta_t;   // Time the control was applied for [s]
+};
+
 /**
  * Struct representing one ground truth position.
  */
@@ -46,6 +55,7 @@ struct LandmarkObs {
   int id;     // Id of matching landmark in the map.
   double x;   // Local (vehicle coords) x position of landmark observation [m]
   double y;   // Local (vehicle coords) y position of landmark observation [m]
+  int class_i; // Class of the observed landmark, 0 if unknown (matches any)
 };
 
 /**
@@ -75,6 +85,7 @@ inline LandmarkObs transform_obs(const double x, const double y, const double th
   transformed_obs.id = obs.id;
   transformed_obs.x = x_map;
   transformed_obs.y = y_map;
+  transformed_obs.class_i = obs.class_i;
   
   return transformed_obs;
 }
@@ -110,7 +121,12 @@ inline double * getError(double gt_x, double gt_y, double gt_theta, double pf_x,
 }
 
 /**
- * Reads map data from a file.
+ * Reads map data from a file. Each line holds x, y, the landmark ID and
+ *   optionally the landmark class (0 if absent). Coordinates are parsed in
+ *   double and stored relative to map.origin_x/origin_y. When the map is still empty and
+ *   has no origin, the origin is first set to the first landmark rounded
+ *   to the kilometre, which keeps large (UTM-scale) coordinates precise
+ *   in float.
  * @param filename Name of file containing map data.
  * @output True if opening and reading file was successful
  */
@@ -130,22 +146,32 @@ inline bool read_map_data(std::string filename, Map& map) {
 
     std::istringstream iss_map(line_map);
 
-    // Declare landmark values and ID
-    float landmark_x_f, landmark_y_f;
-    int id_i;
+    // Declare landmark values, ID and class
+    double landmark_x_f, landmark_y_f;
+    int id_i, class_i;
 
     // Read data from current line to values
     iss_map >> landmark_x_f;
     iss_map >> landmark_y_f;
     iss_map >> id_i;
+    if (!(iss_map >> class_i)) {
+      class_i = 0;
+    }
+
+    // Pick the local origin on the first landmark
+    if (map.landmark_list.empty() && map.origin_x == 0 && map.origin_y == 0) {
+      map.origin_x = 1000.0 * floor(landmark_x_f / 1000.0 + 0.5);
+      map.origin_y = 1000.0 * floor(landmark_y_f / 1000.0 + 0.5);
+    }
 
     // Declare single_landmark
     Map::single_landmark_s single_landmark_temp;
 
     // Set values
     single_landmark_temp.id_i = id_i;
-    single_landmark_temp.x_f  = landmark_x_f;
-    single_landmark_temp.y_f  = landmark_y_f;
+    single_landmark_temp.x_f  = static_cast<float>(landmark_x_f - map.origin_x);
+    single_landmark_temp.y_f  = static_cast<float>(landmark_y_f - map.origin_y);
+    single_landmark_temp.class_i = class_i;
 
     // Add to landmark list of map
     map.landmark_list.push_back(single_landmark_temp);
@@ -239,7 +265,8 @@ inline bool read_gt_data(std::string filename, std::vector<ground_truth>& gt) {
 }
 
 /**
- * Reads landmark observation data from a file.
+ * Reads landmark observation data from a file. Each line holds x, y and
+ *   optionally the landmark class (0 if absent).
  * @param filename Name of file containing landmark observation measurements.
  * @output True if opening and reading file was successful
  */
@@ -260,12 +287,16 @@ inline bool read_landmark_data(std::string filename,
 
     std::istringstream iss_obs(line_obs);
 
-    // Declare position values
+    // Declare position values and class
     double local_x, local_y;
+    int class_i;
 
     //read data from line to values
     iss_obs >> local_x;
     iss_obs >> local_y;
+    if (!(iss_obs >> class_i)) {
+      class_i = 0;
+    }
 
     // Declare single landmark measurement
     LandmarkObs meas;
@@ -273,6 +304,7 @@ inline bool read_landmark_data(std::string filename,
     // Set values
     meas.x = local_x;
     meas.y = local_y;
+    meas.class_i = class_i;
 
     // Add to list of control measurements
     observations.push_back(meas);
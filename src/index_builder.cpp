@@ -0,0 +1,49 @@
+/**
+ * index_builder.cpp
+ * Prebuilds the spatial index of a map file, so that filter processes
+ *   read it instead of building it at startup.
+ *
+ * Usage: index_builder <map_file> [threads]
+ *   Writes the index to <map_file>.idx. Rebuild it whenever the map file
+ *   changes; MapStore ignores an index that does not match the landmarks.
+ */
+
+#include <stdlib.h>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include "helper_functions.h"
+#include "map_store.h"
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0] << " <map_file> [threads]" << std::endl;
+    return -1;
+  }
+  std::string map_file = argv[1];
+  int threads = argc > 2 ? atoi(argv[2]) : std::thread::hardware_concurrency();
+
+  typedef std::chrono::steady_clock Clock;
+  Clock::time_point start = Clock::now();
+  Map map;
+  if (!read_map_data(map_file, map)) {
+    std::cerr << "Error: Could not open map file " << map_file << std::endl;
+    return -1;
+  }
+  map.reorderLandmarks();
+  Clock::time_point loaded = Clock::now();
+  map.buildIndex(threads > 0 ? threads : 1);
+  Clock::time_point built = Clock::now();
+
+  std::string index_file = MapStore::indexFile(map_file);
+  if (!MapStore::saveIndex(map, index_file)) {
+    std::cerr << "Error: Could not write index " << index_file << std::endl;
+    return -1;
+  }
+  std::cout << map.landmark_list.size() << " landmarks: read in "
+            << std::chrono::duration<double>(loaded - start).count() << " s, indexed in "
+            << std::chrono::duration<double>(built - loaded).count() << " s with "
+            << threads << " threads, written to " << index_file << std::endl;
+  return 0;
+}
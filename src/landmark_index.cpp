@@ -0,0 +1,329 @@
+/**
+ * landmark_index.cpp
+ */
+
+#include "landmark_index.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <functional>
+#include <istream>
+#include <limits>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+using std::vector;
+
+namespace {
+
+// Slot of a landmark that is not in the index
+const int kNotIndexed = std::numeric_limits<int>::max();
+
+struct AxisLess {
+  int axis;
+  bool operator()(const IndexPoint &a, const IndexPoint &b) const {
+    return axis ? a.y < b.y : a.x < b.x;
+  }
+};
+
+// Sorts [lo, hi) into an implicit subtree split along the given axis
+void buildTree(vector<IndexPoint> &tree, size_t lo, size_t hi, int axis) {
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    AxisLess less = {axis};
+    std::nth_element(tree.begin() + lo, tree.begin() + mid,
+                     tree.begin() + hi, less);
+    buildTree(tree, lo, mid, !axis);
+    lo = mid + 1;
+    axis = !axis;
+  }
+}
+
+// Subtrees smaller than this are not worth a thread of their own
+const size_t kMinParallelPoints = 1 << 16;
+
+// As buildTree, handing the left subtree of the top levels to new threads
+void buildTreeParallel(vector<IndexPoint> &tree, size_t lo, size_t hi, int axis,
+                       int threads) {
+  if (threads <= 1 || hi - lo < kMinParallelPoints) {
+    buildTree(tree, lo, hi, axis);
+    return;
+  }
+  size_t mid = lo + (hi - lo) / 2;
+  AxisLess less = {axis};
+  std::nth_element(tree.begin() + lo, tree.begin() + mid, tree.begin() + hi, less);
+  int left_threads = threads / 2;
+  std::thread left(buildTreeParallel, std::ref(tree), lo, mid, !axis, left_threads);
+  buildTreeParallel(tree, mid + 1, hi, !axis, threads - left_threads);
+  left.join();
+}
+
+bool writePoints(std::ostream &out, const vector<IndexPoint> &points) {
+  uint64_t n = points.size();
+  out.write(reinterpret_cast<const char *>(&n), sizeof(n));
+  if (n) {
+    out.write(reinterpret_cast<const char *>(points.data()), n * sizeof(IndexPoint));
+  }
+  return static_cast<bool>(out);
+}
+
+// Reads points written by writePoints. The count is checked against the
+//   bytes left in the stream first, so that a corrupt count fails the read
+//   instead of making the resize throw
+bool readPoints(std::istream &in, vector<IndexPoint> &points) {
+  uint64_t n = 0;
+  if (!in.read(reinterpret_cast<char *>(&n), sizeof(n))) {
+    return false;
+  }
+  std::streampos at = in.tellg();
+  in.seekg(0, std::ios::end);
+  std::streampos end = in.tellg();
+  in.seekg(at);
+  if (at < 0 || end < at
+      || n > static_cast<uint64_t>(end - at) / sizeof(IndexPoint)) {
+    return false;
+  }
+  points.resize(n);
+  if (n) {
+    in.read(reinterpret_cast<char *>(points.data()), n * sizeof(IndexPoint));
+  }
+  return static_cast<bool>(in);
+}
+
+// Searches [lo, hi) for a live point closer than best_dist. Coordinates
+//   are relative to the map origin, which keeps float precise around it
+void searchTree(const vector<IndexPoint> &tree, size_t lo, size_t hi, int axis,
+                float x, float y, int &best, float &best_dist) {
+  while (hi > lo) {
+    size_t mid = lo + (hi - lo) / 2;
+    const IndexPoint &node = tree[mid];
+    float dx = x - node.x;
+    float dy = y - node.y;
+    float d = dx * dx + dy * dy;
+    if (d < best_dist && node.landmark >= 0) {
+      best_dist = d;
+      best = node.landmark;
+    }
+
+    // Descend into the near side first, then the far side if the
+    //   splitting line is closer than the best point so far
+    float diff = axis ? dy : dx;
+    if (diff < 0) {
+      searchTree(tree, lo, mid, !axis, x, y, best, best_dist);
+      if (diff * diff >= best_dist) {
+        return;
+      }
+      lo = mid + 1;
+    } else {
+      searchTree(tree, mid + 1, hi, !axis, x, y, best, best_dist);
+      if (diff * diff >= best_dist) {
+        return;
+      }
+      hi = mid;
+    }
+    axis = !axis;
+  }
+}
+
+// As searchTree, but keeps the two closest live points
+void searchTreeTwo(const vector<IndexPoint> &tree, size_t lo, size_t hi, int axis,
+                   float x, float y, int &best, float &best_dist,
+                   float &second_dist) {
+  while (hi > lo) {
+    size_t mid = lo + (hi - lo) / 2;
+    const IndexPoint &node = tree[mid];
+    float dx = x - node.x;
+    float dy = y - node.y;
+    float d = dx * dx + dy * dy;
+    if (d < second_dist && node.landmark >= 0) {
+      if (d < best_dist) {
+        second_dist = best_dist;
+        best_dist = d;
+        best = node.landmark;
+      } else {
+        second_dist = d;
+      }
+    }
+
+    float diff = axis ? dy : dx;
+    if (diff < 0) {
+      searchTreeTwo(tree, lo, mid, !axis, x, y, best, best_dist, second_dist);
+      if (diff * diff >= second_dist) {
+        return;
+      }
+      lo = mid + 1;
+    } else {
+      searchTreeTwo(tree, mid + 1, hi, !axis, x, y, best, best_dist, second_dist);
+      if (diff * diff >= second_dist) {
+        return;
+      }
+      hi = mid;
+    }
+    axis = !axis;
+  }
+}
+
+}  // namespace
+
+void LandmarkIndex::build(vector<IndexPoint> points, int threads) {
+  nodes.swap(points);
+  pending.clear();
+  dead = 0;
+  buildTreeParallel(nodes, 0, nodes.size(), 0, threads);
+  rebuildSlots();
+}
+
+bool LandmarkIndex::save(std::ostream &out) const {
+  uint64_t removed = dead;
+  out.write(reinterpret_cast<const char *>(&removed), sizeof(removed));
+  return writePoints(out, nodes) && writePoints(out, pending);
+}
+
+bool LandmarkIndex::load(std::istream &in, size_t landmarks) {
+  uint64_t removed = 0;
+  bool ok = in.read(reinterpret_cast<char *>(&removed), sizeof(removed))
+            && readPoints(in, nodes) && readPoints(in, pending);
+
+  // Every point must name a distinct landmark of the map, and only the
+  //   main tree holds tombstones, as many as recorded
+  vector<bool> seen(ok ? landmarks : 0, false);
+  uint64_t tombstones = 0;
+  for (size_t i = 0; ok && i < nodes.size() + pending.size(); ++i) {
+    bool in_tree = i < nodes.size();
+    int landmark = in_tree ? nodes[i].landmark : pending[i - nodes.size()].landmark;
+    if (landmark == -1 && in_tree) {
+      ++tombstones;
+    } else if (landmark < 0 || static_cast<size_t>(landmark) >= landmarks
+               || seen[landmark]) {
+      ok = false;
+    } else {
+      seen[landmark] = true;
+    }
+  }
+  if (!ok || tombstones != removed) {
+    *this = LandmarkIndex();
+    return false;
+  }
+  dead = removed;
+  rebuildSlots();
+  return true;
+}
+
+void LandmarkIndex::rebuildSlots() {
+  slot.clear();
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    int landmark = nodes[i].landmark;
+    if (landmark < 0) {
+      continue;
+    }
+    if (landmark >= static_cast<int>(slot.size())) {
+      slot.resize(landmark + 1, kNotIndexed);
+    }
+    slot[landmark] = static_cast<int>(i);
+  }
+  for (size_t i = 0; i < pending.size(); ++i) {
+    int landmark = pending[i].landmark;
+    if (landmark >= static_cast<int>(slot.size())) {
+      slot.resize(landmark + 1, kNotIndexed);
+    }
+    slot[landmark] = ~static_cast<int>(i);
+  }
+}
+
+void LandmarkIndex::insert(const IndexPoint &point) {
+  if (point.landmark >= static_cast<int>(slot.size())) {
+    slot.resize(point.landmark + 1, kNotIndexed);
+  }
+  pending.push_back(point);
+  if (!maybeRebuild()) {
+    rebuildPending();
+  }
+}
+
+bool LandmarkIndex::remove(int landmark) {
+  if (landmark < 0 || landmark >= static_cast<int>(slot.size())) {
+    return false;
+  }
+  int at = slot[landmark];
+  if (at == kNotIndexed) {
+    return false;
+  }
+  slot[landmark] = kNotIndexed;
+  if (at >= 0) {
+    // Keep the point as a splitter, but never report it
+    nodes[at].landmark = -1;
+    ++dead;
+    maybeRebuild();
+  } else {
+    pending[~at] = pending.back();
+    pending.pop_back();
+    rebuildPending();
+  }
+  return true;
+}
+
+void LandmarkIndex::relabel(int from, int to) {
+  if (from >= static_cast<int>(slot.size())) {
+    return;
+  }
+  int at = slot[from];
+  if (at >= 0 && at != kNotIndexed) {
+    nodes[at].landmark = to;
+  } else if (at < 0) {
+    pending[~at].landmark = to;
+  }
+  slot[to] = at;
+  slot.resize(from);
+}
+
+void LandmarkIndex::rebuildPending() {
+  buildTree(pending, 0, pending.size(), 0);
+  for (size_t i = 0; i < pending.size(); ++i) {
+    slot[pending[i].landmark] = ~static_cast<int>(i);
+  }
+}
+
+bool LandmarkIndex::maybeRebuild() {
+  // The pending tree is re-sorted on every edit and tombstones waste tree
+  //   visits; merge everything once either passes its budget
+  size_t max_pending = 32 + static_cast<size_t>(sqrt(static_cast<double>(nodes.size())));
+  if (pending.size() <= max_pending && dead * 4 <= nodes.size()) {
+    return false;
+  }
+  vector<IndexPoint> points;
+  points.reserve(size());
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    if (nodes[i].landmark >= 0) {
+      points.push_back(nodes[i]);
+    }
+  }
+  points.insert(points.end(), pending.begin(), pending.end());
+  build(points);
+  ++rebuilds;
+  return true;
+}
+
+int LandmarkIndex::nearest(double x, double y) const {
+  int best = -1;
+  float qx = static_cast<float>(x);
+  float qy = static_cast<float>(y);
+  float best_dist = std::numeric_limits<float>::infinity();
+  searchTree(nodes, 0, nodes.size(), 0, qx, qy, best, best_dist);
+  searchTree(pending, 0, pending.size(), 0, qx, qy, best, best_dist);
+  return best;
+}
+
+void LandmarkIndex::nearestTwo(double x, double y, int &first, double &first_dist,
+                               double &second_dist) const {
+  first = -1;
+  float qx = static_cast<float>(x);
+  float qy = static_cast<float>(y);
+  float best_dist = std::numeric_limits<float>::infinity();
+  float next_dist = best_dist;
+  searchTreeTwo(nodes, 0, nodes.size(), 0, qx, qy, first, best_dist, next_dist);
+  searchTreeTwo(pending, 0, pending.size(), 0, qx, qy, first, best_dist, next_dist);
+  first_dist = sqrt(best_dist);
+  second_dist = sqrt(next_dist);
+}
@@ -0,0 +1,138 @@
+/**
+ * landmark_index.h
+ * Spatial index for nearest-landmark queries.
+ *
+ * The index is an implicit 2d-tree: the points are stored in one array,
+ *   each subrange [lo, hi) being split at its middle element, alternately
+ *   along x and y. No child pointers are stored.
+ *
+ * Landmarks can be inserted and removed after the build: removed points
+ *   stay in the tree as tombstones and inserted points go to a second,
+ *   small tree of pending points that is re-sorted on each edit. The main
+ *   tree is rebuilt lazily once either grows past its budget.
+ *
+ * The build can split the top levels of the tree across threads, and a
+ *   built index can be saved and read back as raw arrays.
+ */
+
+#ifndef LANDMARK_INDEX_H_
+#define LANDMARK_INDEX_H_
+
+#include <stddef.h>
+#include <iosfwd>
+#include <vector>
+
+/**
+ * Struct representing one indexed landmark.
+ */
+struct IndexPoint {
+  float x;       // Landmark x-position in the map [m]
+  float y;       // Landmark y-position in the map [m]
+  int landmark;  // Position of the landmark in Map::landmark_list
+};
+
+class LandmarkIndex {
+ public:
+  LandmarkIndex() : dead(0), rebuilds(0) {}
+
+  /**
+   * build Builds the tree over the given points.
+   * @param points Points to index, taken over by the index
+   * @param threads Threads to build with
+   */
+  void build(std::vector<IndexPoint> points, int threads = 1);
+
+  /**
+   * save Writes the index to a binary stream, in native byte order.
+   * @output False if writing failed
+   */
+  bool save(std::ostream &out) const;
+
+  /**
+   * load Reads an index written by save.
+   * @param landmarks Number of landmarks in the map the index belongs to;
+   *   points naming any other landmark make the index invalid
+   * @output False if the stream does not hold a valid index
+   */
+  bool load(std::istream &in, size_t landmarks);
+
+  /**
+   * insert Adds a landmark to the index.
+   */
+  void insert(const IndexPoint &point);
+
+  /**
+   * remove Removes a landmark from the index.
+   * @param landmark Position of the landmark in Map::landmark_list
+   * @output False if the landmark was not indexed
+   */
+  bool remove(int landmark);
+
+  /**
+   * relabel Records that a landmark moved to another position of
+   *   Map::landmark_list.
+   * @param from Old position, which must be the highest indexed one if
+   *   it is indexed at all
+   * @param to New position, which must not be indexed
+   */
+  void relabel(int from, int to);
+
+  /**
+   * rebuildCount Returns how many lazy rebuilds the edits have caused.
+   */
+  int rebuildCount() const {
+    return rebuilds;
+  }
+
+  /**
+   * nearest Finds the landmark closest to a point.
+   * @param (x,y) Query point in map coordinates [m]
+   * @output Position of the landmark in Map::landmark_list, -1 if empty
+   */
+  int nearest(double x, double y) const;
+
+  /**
+   * nearestTwo Finds the landmark closest to a point and the distances to
+   *   it and to the second closest one.
+   * @param (x,y) Query point in map coordinates [m]
+   * @param first Receives the position of the closest landmark, -1 if empty
+   * @param (first_dist, second_dist) Receive the two distances [m],
+   *   infinity where the index holds fewer landmarks
+   */
+  void nearestTwo(double x, double y, int &first, double &first_dist,
+                  double &second_dist) const;
+
+  /**
+   * empty Returns whether the index holds no landmarks.
+   */
+  bool empty() const {
+    return size() == 0;
+  }
+
+  /**
+   * size Returns the number of indexed landmarks.
+   */
+  size_t size() const {
+    return nodes.size() - dead + pending.size();
+  }
+
+ private:
+  // Re-sorts the pending points into their own small tree
+  void rebuildPending();
+
+  // Recomputes the slot of every landmark from the trees
+  void rebuildSlots();
+
+  // Merges everything into a new tree when the edits have degraded it
+  //   enough; returns whether it did
+  bool maybeRebuild();
+
+  std::vector<IndexPoint> nodes;    // Tree; removed points have landmark -1
+  std::vector<IndexPoint> pending;  // Tree of points inserted since the build
+  std::vector<int> slot;            // Tree position of each landmark, or
+                                    //   ~position in pending
+  size_t dead;                      // Removed points still in the tree
+  int rebuilds;                     // Lazy rebuilds so far
+};
+
+#endif  // LANDMARK_INDEX_H_
@@ -1,9 +1,16 @@
 #include <math.h>
+#include <signal.h>
+#include <stdlib.h>
 #include <uWS/uWS.h>
+#include <chrono>
+#include <fstream>
 #include <iostream>
 #include <string>
+#include "filter_config.h"
 #include "json.hpp"
+#include "map_store.h"
 #include "particle_filter.h"
+#include "particle_recorder.h"
 
 // for convenience
 using nlohmann::json;
@@ -25,29 +32,119 @@ string hasData(string s) {
   return "";
 }
 
-int main() {
+// Set by SIGHUP to request a map reload
+volatile sig_atomic_t reload_requested = 0;
+
+void requestReload(int) {
+  reload_requested = 1;
+}
+
+int main(int argc, char *argv[]) {
+  std::chrono::steady_clock::time_point startup = std::chrono::steady_clock::now();
   uWS::Hub h;
 
   // Set up parameters here
   double delta_t = 0.1;  // Time elapsed between measurements [sec]
   double sensor_range = 50;  // Sensor range [m]
+  int num_particles = 100;
+
+  // Distance from the local origin that triggers a recentre of the filter [m]
+  double recentre_distance = 2000;
 
   // GPS measurement uncertainty [x [m], y [m], theta [rad]]
   double sigma_pos [3] = {0.3, 0.3, 0.01};
   // Landmark measurement uncertainty [x [m], y [m]]
   double sigma_landmark [2] = {0.3, 0.3};
 
-  // Read map data
-  Map map;
-  if (!read_map_data("../data/map_data.txt", map)) {
+  // Read map data in the background so that the server listens at once.
+  //   Until the map is published the filter only predicts; a map small
+  //   enough for brute-force association is published before its index.
+  //   SIGHUP reloads the map without dropping the filter state
+  string map_file = "../data/map_data.txt";
+  const size_t max_unindexed = 100000;
+  if (!std::ifstream(map_file.c_str())) {
     std::cout << "Error: Could not open map file" << std::endl;
     return -1;
   }
+  // Execution parameters: --profile <file> reads them from a profile,
+  //   --autotune times them on the map before serving (and saves them
+  //   to the profile if one is given)
+  FilterConfig config;
+  string profile_file;
+  bool tune = false;
+  for (int i = 1; i < argc; ++i) {
+    if (string(argv[i]) == "--profile" && i + 1 < argc) {
+      profile_file = argv[++i];
+    } else if (string(argv[i]) == "--autotune") {
+      tune = true;
+    }
+  }
+  if (tune) {
+    Map tune_map;
+    read_map_data(map_file, tune_map);
+    tune_map.reorderLandmarks();
+    config = autotune(tune_map, num_particles, &std::cout);
+    if (!profile_file.empty() && !saveConfig(config, profile_file)) {
+      std::cout << "Error: Could not write profile " << profile_file << std::endl;
+    }
+  } else if (!profile_file.empty() && !loadConfig(profile_file, config)) {
+    std::cout << "Error: Could not read profile " << profile_file << std::endl;
+    return -1;
+  }
+
+  MapStore maps;
+  applyConfig(config, maps);
+  maps.reloadAsync(map_file, max_unindexed);
+  signal(SIGHUP, requestReload);
+  bool estimated = false, indexed = false;
 
   // Create particle filter
-  ParticleFilter pf;
+  ParticleFilter pf(num_particles);
+  applyConfig(config, pf);
+
+  // Optionally run as a Kalman filter while the posterior is unimodal:
+  //   --hybrid; inject particles to recover from kidnapping: --augmented;
+  //   steer the particles with the observations: --optimal-proposal;
+  //   spread the resampled particles over a kernel: --regularized;
+  //   and report a pose refined below the particle spacing, which takes
+  //   fewer particles for the same precision: --refine
+  bool refine = false;
+  for (int i = 1; i < argc; ++i) {
+    if (string(argv[i]) == "--hybrid") {
+      pf.setHybrid(true);
+    } else if (string(argv[i]) == "--augmented") {
+      pf.setAugmented(true);
+    } else if (string(argv[i]) == "--optimal-proposal") {
+      pf.setProposal(ParticleFilter::kProposalOptimal);
+    } else if (string(argv[i]) == "--regularized") {
+      pf.setRegularized(true);
+    } else if (string(argv[i]) == "--refine") {
+      refine = true;
+    }
+  }
+
+  // Optionally send smoothed poses a few steps back along with the
+  //   estimate, for mapping: --smooth <lag>
+  int smooth_lag = 0;
+  for (int i = 1; i + 1 < argc; ++i) {
+    if (string(argv[i]) == "--smooth") {
+      smooth_lag = atoi(argv[i + 1]);
+      pf.enableSmoothing(smooth_lag);
+    }
+  }
+
+  // Optionally record the particle clouds: --record <file>
+  ParticleRecorder recorder;
+  uint32_t step = 0;
+  for (int i = 1; i + 1 < argc; ++i) {
+    if (string(argv[i]) == "--record" && !recorder.open(argv[i + 1])) {
+      std::cout << "Error: Could not create recording " << argv[i + 1] << std::endl;
+      return -1;
+    }
+  }
 
-  h.onMessage([&pf,&map,&delta_t,&sensor_range,&sigma_pos,&sigma_landmark]
+  h.onMessage([&pf,&maps,&map_file,&recentre_distance,&delta_t,&sensor_range,&sigma_pos,&sigma_landmark,
+               &recorder,&step,&startup,&estimated,&indexed,&refine,&smooth_lag]
               (uWS::WebSocket<uWS::SERVER> ws, char *data, size_t length, 
                uWS::OpCode opCode) {
     // "42" at the start of the message means there's a websocket message event.
@@ -62,6 +159,14 @@ int main() {
         string event = j[0].get<string>();
         
         if (event == "telemetry") {
+          if (reload_requested) {
+            reload_requested = 0;
+            maps.reloadAsync(map_file);
+          }
+
+          // Hold the current map for the whole step
+          std::shared_ptr<const Map> map = maps.current();
+
           // j[1] is the data JSON object
           if (!pf.initialized()) {
             // Sense noisy position data from the simulator
@@ -104,12 +209,28 @@ int main() {
             LandmarkObs obs;
             obs.x = x_sense[i];
             obs.y = y_sense[i];
+            obs.class_i = 0;
             noisy_observations.push_back(obs);
           }
 
-          // Update the weights and resample
-          pf.updateWeights(sensor_range, sigma_landmark, noisy_observations, map);
-          pf.resample();
+          // Update the weights and resample once there is a map
+          if (map) {
+            pf.updateWeights(sensor_range, sigma_landmark, noisy_observations, *map);
+            pf.resample();
+
+            double since_startup = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - startup).count();
+            if (!estimated) {
+              estimated = true;
+              std::cout << "first estimate " << since_startup << " s after startup"
+                        << (map->index.empty() ? " (unindexed map)" : "") << std::endl;
+            }
+            if (!indexed && !map->index.empty()) {
+              indexed = true;
+              std::cout << "map index in use " << since_startup << " s after startup"
+                        << std::endl;
+            }
+          }
 
           // Calculate and output the average weighted error of the particle 
           //   filter over all time steps so far.
@@ -130,10 +251,41 @@ int main() {
           std::cout << "highest w " << highest_weight << std::endl;
           std::cout << "average w " << weight_sum/num_particles << std::endl;
 
+          const FilterStats &stats = pf.stats();
+          std::cout << "ess " << stats.ess
+                    << " entropy " << stats.entropy
+                    << " ancestors " << stats.unique_ancestors
+                    << " zero w " << stats.zero_weights
+                    << " underflow w " << stats.underflow_weights
+                    << " injected " << stats.injected
+                    << " spread " << stats.spread
+                    << (pf.collapsed() ? " (Kalman)" : "") << std::endl;
+
+          // Refine the weighted mean against the observations, with the
+          //   spread of the particles as its prior
+          double pose_x = best_particle.x;
+          double pose_y = best_particle.y;
+          double pose_theta = best_particle.theta;
+          if (refine && map) {
+            PoseEstimate estimate = pf.latestEstimate();
+            pose_x = estimate.x - pf.originX();
+            pose_y = estimate.y - pf.originY();
+            pose_theta = estimate.theta;
+            pf.refinePose(pose_x, pose_y, pose_theta, sigma_landmark,
+                          noisy_observations, *map, estimate.cov);
+          }
+
           json msgJson;
-          msgJson["best_particle_x"] = best_particle.x;
-          msgJson["best_particle_y"] = best_particle.y;
-          msgJson["best_particle_theta"] = best_particle.theta;
+          msgJson["best_particle_x"] = pf.originX() + pose_x;
+          msgJson["best_particle_y"] = pf.originY() + pose_y;
+          msgJson["best_particle_theta"] = pose_theta;
+          vector<PoseEstimate> smoothed;
+          if (smooth_lag > 0 && pf.smoothedTrajectory(smooth_lag, smoothed)) {
+            msgJson["smoothed_x"] = smoothed[0].x;
+            msgJson["smoothed_y"] = smoothed[0].y;
+            msgJson["smoothed_theta"] = smoothed[0].theta;
+            msgJson["smoothed_stamp"] = smoothed[0].stamp;
+          }
 
           // Optional message data used for debugging particle's sensing 
           //   and associations
@@ -144,6 +296,17 @@ int main() {
           auto msg = "42[\"best_particle\"," + msgJson.dump() + "]";
           // std::cout << msg << std::endl;
           ws.send(msg.data(), msg.length(), uWS::OpCode::TEXT);
+
+          recorder.record(step++, pf.particles, pf.originX(), pf.originY(),
+                          pf.originX() + pose_x, pf.originY() + pose_y,
+                          pose_theta);
+
+          // Particles are relative to the local origin of the filter; move
+          //   it along once the vehicle gets far from it. The map keeps its
+          //   own origin
+          if (dist(0, 0, pose_x, pose_y) > recentre_distance) {
+            pf.recenter(pf.originX() + pose_x, pf.originY() + pose_y);
+          }
         }  // end "telemetry" if
       } else {
         string msg = "42[\"manual\",{}]";
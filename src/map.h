@@ -8,17 +8,335 @@
 #ifndef MAP_H_
 #define MAP_H_
 
+#include <algorithm>
+#include <unordered_map>
+#include <utility>
 #include <vector>
+#include "compact_map.h"
+#include "landmark_index.h"
+#include "morton.h"
+#include "nearest_raster.h"
 
 class Map {
  public:  
+  Map() : origin_x(0), origin_y(0) {}
+
   struct single_landmark_s {
     int id_i ; // Landmark ID
-    float x_f; // Landmark x-position in the map (global coordinates)
-    float y_f; // Landmark y-position in the map (global coordinates)
+    float x_f; // Landmark x-position in the map (relative to the origin)
+    float y_f; // Landmark y-position in the map (relative to the origin)
+    int class_i; // Landmark class (pole, sign, ...), 0 if unclassified
   };
 
+  double origin_x; // Global position of the map origin [m], which landmark
+  double origin_y; //   coordinates are relative to. Set when loading and
+                   //   never moved, so the float coordinates, indices,
+                   //   raster and compact tiles are rounded once and
+                   //   shared by every filter whatever its own origin
+
   std::vector<single_landmark_s> landmark_list; // List of landmarks in the map
+
+  LandmarkIndex index; // Spatial index over landmark_list, empty until built
+
+  std::vector<LandmarkIndex> class_index; // Spatial index of the landmarks of
+                                          //   each class, by class number
+
+  /**
+   * nearestOfClass Finds the closest landmark of a class with the class
+   *   indices.
+   * @output Position of the landmark in landmark_list, or -1 if the map
+   *   has no indexed landmark of that class
+   */
+  int nearestOfClass(double x, double y, int class_i) const {
+    if (class_i <= 0 || class_i >= static_cast<int>(class_index.size())) {
+      return -1;
+    }
+    return class_index[class_i].nearest(x, y);
+  }
+
+  CompactMap compact; // Quantized landmarks, replacing landmark_list once built
+
+  NearestRaster raster; // Nearest landmark of each grid cell, empty until built
+
+  std::vector<int> original_position; // File position of each landmark after
+                                      //   reorderLandmarks() (-1 if added at
+                                      //   runtime), empty before
+
+  /**
+   * buildIndex (Re)builds the spatial index over landmark_list, and the
+   *   index of each landmark class.
+   * @param threads Threads to build with
+   */
+  void buildIndex(int threads = 1) {
+    std::vector<IndexPoint> points(landmark_list.size());
+    std::vector<std::vector<IndexPoint> > class_points;
+    for (size_t i = 0; i < landmark_list.size(); ++i) {
+      points[i].x = landmark_list[i].x_f;
+      points[i].y = landmark_list[i].y_f;
+      points[i].landmark = static_cast<int>(i);
+      int class_i = landmark_list[i].class_i;
+      if (class_i > 0) {
+        if (class_i >= static_cast<int>(class_points.size())) {
+          class_points.resize(class_i + 1);
+        }
+        class_points[class_i].push_back(points[i]);
+      }
+    }
+    index.build(points, threads);
+    class_index.assign(class_points.size(), LandmarkIndex());
+    for (size_t c = 0; c < class_points.size(); ++c) {
+      class_index[c].build(class_points[c], threads);
+    }
+  }
+
+  /**
+   * buildRaster Precomputes the nearest landmark of every cell of a grid
+   *   covering the landmarks plus a margin, so that the association is an
+   *   array lookup away from Voronoi boundaries. Builds the index first if
+   *   needed. The landmark edit methods drop the raster.
+   * @param resolution Edge of a cell [m]
+   * @param margin Distance the grid extends past the outer landmarks [m]
+   */
+  void buildRaster(double resolution = 0.5, double margin = 50) {
+    if (landmark_list.empty()) {
+      raster.clear();
+      return;
+    }
+    if (index.empty()) {
+      buildIndex();
+    }
+    float min_x = landmark_list[0].x_f, max_x = min_x;
+    float min_y = landmark_list[0].y_f, max_y = min_y;
+    for (size_t i = 1; i < landmark_list.size(); ++i) {
+      min_x = std::min(min_x, landmark_list[i].x_f);
+      max_x = std::max(max_x, landmark_list[i].x_f);
+      min_y = std::min(min_y, landmark_list[i].y_f);
+      max_y = std::max(max_y, landmark_list[i].y_f);
+    }
+    raster.build(index, min_x - margin, min_y - margin, max_x + margin,
+                 max_y + margin, resolution);
+  }
+
+  /**
+   * reorderLandmarks Sorts landmark_list along a Morton curve so that
+   *   landmarks close in the map are close in memory, and records their
+   *   file positions in original_position. Rebuilds the index and remaps
+   *   the raster if built.
+   */
+  void reorderLandmarks() {
+    size_t n = landmark_list.size();
+    if (n == 0) {
+      return;
+    }
+    float min_x = landmark_list[0].x_f, max_x = min_x;
+    float min_y = landmark_list[0].y_f, max_y = min_y;
+    for (size_t i = 1; i < n; ++i) {
+      min_x = std::min(min_x, landmark_list[i].x_f);
+      max_x = std::max(max_x, landmark_list[i].x_f);
+      min_y = std::min(min_y, landmark_list[i].y_f);
+      max_y = std::max(max_y, landmark_list[i].y_f);
+    }
+    double extent = std::max(max_x - min_x, max_y - min_y);
+    double scale = extent > 0 ? 65535 / extent : 0;
+
+    std::vector<std::pair<uint32_t, int> > order(n);
+    for (size_t i = 0; i < n; ++i) {
+      order[i].first = mortonCode(landmark_list[i].x_f, landmark_list[i].y_f,
+                                  min_x, min_y, scale);
+      order[i].second = static_cast<int>(i);
+    }
+    std::sort(order.begin(), order.end());
+
+    std::vector<single_landmark_s> sorted(n);
+    std::vector<int> sorted_position(n);
+    for (size_t i = 0; i < n; ++i) {
+      int from = order[i].second;
+      sorted[i] = landmark_list[from];
+      sorted_position[i] = original_position.empty() ? from : original_position[from];
+    }
+    original_position.swap(sorted_position);
+    landmark_list.swap(sorted);
+    id_position.clear();
+    if (!index.empty()) {
+      buildIndex();
+    }
+    if (!raster.empty()) {
+      std::vector<int> new_position(n);
+      for (size_t i = 0; i < n; ++i) {
+        new_position[order[i].second] = static_cast<int>(i);
+      }
+      raster.remap(new_position);
+    }
+  }
+
+  /**
+   * compactify Encodes the landmarks into the compact representation and
+   *   frees landmark_list and its index. Landmark positions returned by
+   *   the association then refer to the compact order, and the edit
+   *   methods below no longer apply. The compact map does not keep
+   *   landmark classes.
+   * @param tile_size Edge of a compact tile [m]
+   */
+  void compactify(double tile_size = 256) {
+    std::vector<double> x(landmark_list.size()), y(landmark_list.size());
+    std::vector<int> id(landmark_list.size());
+    for (size_t i = 0; i < landmark_list.size(); ++i) {
+      x[i] = landmark_list[i].x_f;
+      y[i] = landmark_list[i].y_f;
+      id[i] = landmark_list[i].id_i;
+    }
+    compact.build(x, y, id, tile_size);
+    std::vector<single_landmark_s>().swap(landmark_list);
+    original_position.clear();
+    index = LandmarkIndex();
+    class_index.clear();
+    raster.clear();
+    id_position.clear();
+  }
+
+  /**
+   * landmarkPosition Returns the position of a landmark from whichever
+   *   representation the map holds.
+   * @param i Landmark position as returned by the association
+   */
+  void landmarkPosition(int i, double &x, double &y) const {
+    if (!compact.empty()) {
+      compact.position(i, x, y);
+    } else {
+      x = landmark_list[i].x_f;
+      y = landmark_list[i].y_f;
+    }
+  }
+
+  /**
+   * addLandmark Adds a landmark, updating the indices if there are some.
+   * @param id Landmark ID, which must not be in the map yet
+   * @param (x,y) Landmark position in the map [m]
+   * @param class_i Landmark class, 0 if unclassified
+   */
+  void addLandmark(int id, float x, float y, int class_i = 0) {
+    syncIdPositions();
+    int at = static_cast<int>(landmark_list.size());
+    single_landmark_s landmark = {id, x, y, class_i};
+    raster.clear();
+    landmark_list.push_back(landmark);
+    id_position[id] = at;
+    if (!original_position.empty()) {
+      original_position.push_back(-1);
+    }
+    if (!index.empty()) {
+      IndexPoint point = {x, y, at};
+      index.insert(point);
+      if (class_i > 0) {
+        if (class_i >= static_cast<int>(class_index.size())) {
+          class_index.resize(class_i + 1);
+        }
+        class_index[class_i].insert(point);
+      }
+    }
+  }
+
+  /**
+   * moveLandmark Changes the position and optionally the class of a
+   *   landmark.
+   * @param class_i New landmark class, 0 if unclassified, negative to
+   *   keep the current one
+   * @output False if there is no landmark with that ID
+   */
+  bool moveLandmark(int id, float x, float y, int class_i = -1) {
+    syncIdPositions();
+    std::unordered_map<int, int>::const_iterator it = id_position.find(id);
+    if (it == id_position.end()) {
+      return false;
+    }
+    landmark_list[it->second].x_f = x;
+    landmark_list[it->second].y_f = y;
+    raster.clear();
+    IndexPoint point = {x, y, it->second};
+    if (index.remove(it->second)) {
+      index.insert(point);
+    }
+    LandmarkIndex *by_class = classIndexOf(it->second);
+    if (class_i < 0 || class_i == landmark_list[it->second].class_i) {
+      if (by_class && by_class->remove(it->second)) {
+        by_class->insert(point);
+      }
+      return true;
+    }
+
+    // Move the landmark to the index of its new class
+    if (by_class) {
+      by_class->remove(it->second);
+    }
+    landmark_list[it->second].class_i = class_i;
+    if (!index.empty() && class_i > 0) {
+      if (class_i >= static_cast<int>(class_index.size())) {
+        class_index.resize(class_i + 1);
+      }
+      class_index[class_i].insert(point);
+    }
+    return true;
+  }
+
+  /**
+   * removeLandmark Removes a landmark. The last landmark of the list
+   *   takes its position.
+   * @output False if there is no landmark with that ID
+   */
+  bool removeLandmark(int id) {
+    syncIdPositions();
+    std::unordered_map<int, int>::iterator it = id_position.find(id);
+    if (it == id_position.end()) {
+      return false;
+    }
+    int at = it->second;
+    int last = static_cast<int>(landmark_list.size()) - 1;
+    raster.clear();
+    id_position.erase(it);
+    index.remove(at);
+    if (LandmarkIndex *by_class = classIndexOf(at)) {
+      by_class->remove(at);
+    }
+    if (at != last) {
+      landmark_list[at] = landmark_list[last];
+      id_position[landmark_list[at].id_i] = at;
+      if (!original_position.empty()) {
+        original_position[at] = original_position[last];
+      }
+      index.relabel(last, at);
+      if (LandmarkIndex *by_class = classIndexOf(at)) {
+        by_class->relabel(last, at);
+      }
+    }
+    landmark_list.pop_back();
+    if (!original_position.empty()) {
+      original_position.pop_back();
+    }
+    return true;
+  }
+
+ private:
+  std::unordered_map<int, int> id_position; // Position of each landmark ID
+
+  // Returns the class index holding the landmark at position i, if any
+  LandmarkIndex *classIndexOf(int i) {
+    int class_i = landmark_list[i].class_i;
+    if (class_i <= 0 || class_i >= static_cast<int>(class_index.size())) {
+      return 0;
+    }
+    return &class_index[class_i];
+  }
+
+  // Rebuilds the ID lookup if landmark_list was filled directly
+  void syncIdPositions() {
+    if (id_position.size() == landmark_list.size()) {
+      return;
+    }
+    id_position.clear();
+    for (size_t i = 0; i < landmark_list.size(); ++i) {
+      id_position[landmark_list[i].id_i] = static_cast<int>(i);
+    }
+  }
 };
 
 #endif  // MAP_H_
@@ -0,0 +1,228 @@
+/**
+ * map_store.cpp
+ */
+
+#include "map_store.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "helper_functions.h"
+
+using std::shared_ptr;
+using std::string;
+
+namespace {
+
+const uint32_t kIndexMagic = 0x58494650;  // "PFIX"
+const uint32_t kIndexVersion = 1;
+
+// FNV-1a hash of the landmarks an index refers to
+uint64_t landmarkChecksum(const Map &map) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < map.landmark_list.size(); ++i) {
+    const Map::single_landmark_s &landmark = map.landmark_list[i];
+    int32_t fields[4] = {landmark.id_i, 0, 0, landmark.class_i};
+    memcpy(&fields[1], &landmark.x_f, sizeof(float));
+    memcpy(&fields[2], &landmark.y_f, sizeof(float));
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(fields);
+    for (size_t b = 0; b < sizeof(fields); ++b) {
+      hash = (hash ^ bytes[b]) * 1099511628211ULL;
+    }
+  }
+  return hash;
+}
+
+}  // namespace
+
+MapStore::MapStore()
+    : reclaimer(std::make_shared<Reclaimer>()), busy(false), generation_count(0),
+      indexed(true), raster_resolution(0) {
+  reclaimer_thread = std::thread(reclaim, reclaimer);
+}
+
+MapStore::~MapStore() {
+  if (loader.joinable()) {
+    loader.join();
+  }
+  std::atomic_store(&snapshot, shared_ptr<const Map>());
+  {
+    std::lock_guard<std::mutex> lock(reclaimer->mutex);
+    reclaimer->stopping = true;
+  }
+  reclaimer->ready.notify_one();
+  reclaimer_thread.join();
+}
+
+void MapStore::Reclaimer::retire(shared_ptr<const Map> map) {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (stopping) {
+    lock.unlock();
+    return;  // Freed here, as the reclaimer thread is gone
+  }
+  retired.push_back(std::move(map));
+  lock.unlock();
+  ready.notify_one();
+}
+
+void MapStore::reclaim(shared_ptr<Reclaimer> reclaimer) {
+  std::vector<shared_ptr<const Map> > batch;
+  std::unique_lock<std::mutex> lock(reclaimer->mutex);
+  while (true) {
+    reclaimer->ready.wait(lock, [&reclaimer] {
+      return reclaimer->stopping || !reclaimer->retired.empty();
+    });
+    batch.swap(reclaimer->retired);
+    if (batch.empty() && reclaimer->stopping) {
+      return;
+    }
+    lock.unlock();
+    batch.clear();
+    lock.lock();
+  }
+}
+
+bool MapStore::load(const string &filename, size_t max_unindexed) {
+  shared_ptr<Map> map = std::make_shared<Map>();
+  if (!read_map_data(filename, *map)) {
+    return false;
+  }
+  map->reorderLandmarks();
+  if (!indexed) {
+    publish(map);
+    return true;
+  }
+  if (!loadIndex(*map, indexFile(filename))) {
+    if (map->landmark_list.size() <= max_unindexed) {
+      publish(std::make_shared<Map>(*map));
+    }
+    map->buildIndex(std::max(1u, std::thread::hardware_concurrency()));
+  }
+  if (raster_resolution > 0) {
+    publish(std::make_shared<Map>(*map));
+    map->buildRaster(raster_resolution);
+  }
+  publish(map);
+  return true;
+}
+
+int MapStore::applyEdits(const std::vector<LandmarkEdit> &edits) {
+  std::lock_guard<std::mutex> lock(writer_mutex);
+  shared_ptr<const Map> base = current();
+  shared_ptr<Map> map = base ? std::make_shared<Map>(*base) : std::make_shared<Map>();
+  base.reset();
+
+  int applied = 0;
+  for (size_t i = 0; i < edits.size(); ++i) {
+    const LandmarkEdit &edit = edits[i];
+    switch (edit.kind) {
+      case LandmarkEdit::kAdd:
+        map->addLandmark(edit.id, edit.x, edit.y, edit.class_i > 0 ? edit.class_i : 0);
+        ++applied;
+        break;
+      case LandmarkEdit::kMove:
+        applied += map->moveLandmark(edit.id, edit.x, edit.y, edit.class_i);
+        break;
+      case LandmarkEdit::kRemove:
+        applied += map->removeLandmark(edit.id);
+        break;
+    }
+  }
+  swapIn(map);
+  return applied;
+}
+
+bool MapStore::reloadAsync(const string &filename, size_t max_unindexed) {
+  if (busy.exchange(true)) {
+    return false;
+  }
+  if (loader.joinable()) {
+    loader.join();
+  }
+  loader = std::thread([this, filename, max_unindexed] {
+    if (!load(filename, max_unindexed)) {
+      std::cout << "Error: Could not open map file " << filename << std::endl;
+    }
+    busy = false;
+  });
+  return true;
+}
+
+bool MapStore::saveIndex(const Map &map, const string &filename) {
+  // Write beside the file and rename over it, so that a crash or a full
+  //   disk never leaves a truncated index for the next load
+  string temp = filename + ".tmp";
+  std::ofstream out(temp.c_str(), std::ofstream::binary | std::ofstream::trunc);
+  uint64_t count = map.landmark_list.size();
+  uint64_t checksum = landmarkChecksum(map);
+  uint32_t classes = static_cast<uint32_t>(map.class_index.size());
+  out.write(reinterpret_cast<const char *>(&kIndexMagic), sizeof(kIndexMagic));
+  out.write(reinterpret_cast<const char *>(&kIndexVersion), sizeof(kIndexVersion));
+  out.write(reinterpret_cast<const char *>(&count), sizeof(count));
+  out.write(reinterpret_cast<const char *>(&checksum), sizeof(checksum));
+  out.write(reinterpret_cast<const char *>(&classes), sizeof(classes));
+  bool ok = map.index.save(out);
+  for (size_t c = 0; c < map.class_index.size(); ++c) {
+    ok = ok && map.class_index[c].save(out);
+  }
+  out.close();
+  if (!ok || !out || rename(temp.c_str(), filename.c_str()) != 0) {
+    remove(temp.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool MapStore::loadIndex(Map &map, const string &filename) {
+  std::ifstream in(filename.c_str(), std::ifstream::binary);
+  uint32_t magic = 0, version = 0, classes = 0;
+  uint64_t count = 0, checksum = 0;
+  in.read(reinterpret_cast<char *>(&magic), sizeof(magic));
+  in.read(reinterpret_cast<char *>(&version), sizeof(version));
+  in.read(reinterpret_cast<char *>(&count), sizeof(count));
+  in.read(reinterpret_cast<char *>(&checksum), sizeof(checksum));
+  in.read(reinterpret_cast<char *>(&classes), sizeof(classes));
+  if (!in || magic != kIndexMagic || version != kIndexVersion
+      || count != map.landmark_list.size() || checksum != landmarkChecksum(map)) {
+    return false;
+  }
+
+  // The class indices are read one at a time rather than allocated up
+  //   front, so that a corrupt class count runs out of stream instead
+  bool ok = map.index.load(in, count);
+  map.class_index.clear();
+  for (uint32_t c = 0; ok && c < classes; ++c) {
+    map.class_index.push_back(LandmarkIndex());
+    ok = map.class_index.back().load(in, count);
+  }
+  if (!ok) {
+    map.index = LandmarkIndex();
+    map.class_index.clear();
+  }
+  return ok;
+}
+
+void MapStore::publish(shared_ptr<const Map> map) {
+  std::lock_guard<std::mutex> lock(writer_mutex);
+  swapIn(map);
+}
+
+void MapStore::swapIn(shared_ptr<const Map> map) {
+  // Readers share a handle whose deleter passes the map to the reclaimer,
+  //   so whichever thread drops the last reference only queues it
+  shared_ptr<Reclaimer> to = reclaimer;
+  shared_ptr<const Map> handle;
+  if (map) {
+    handle = shared_ptr<const Map>(map.get(), [to, map](const Map *) mutable {
+      to->retire(std::move(map));
+    });
+  }
+  std::atomic_exchange(&snapshot, handle);
+  ++generation_count;
+}
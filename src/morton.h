@@ -0,0 +1,49 @@
+/**
+ * morton.h
+ * Morton (Z-order) codes for ordering 2D data by locality.
+ */
+
+#ifndef MORTON_H_
+#define MORTON_H_
+
+#include <stdint.h>
+
+/**
+ * Spreads the low 16 bits of a value to the even bit positions.
+ */
+inline uint32_t mortonSpread(uint32_t v) {
+  v &= 0xffff;
+  v = (v | (v << 8)) & 0x00ff00ff;
+  v = (v | (v << 4)) & 0x0f0f0f0f;
+  v = (v | (v << 2)) & 0x33333333;
+  v = (v | (v << 1)) & 0x55555555;
+  return v;
+}
+
+/**
+ * Interleaves the bits of two 16-bit grid coordinates. Points close on
+ *   the grid tend to get close codes.
+ * @param (x,y) Grid coordinates, only the low 16 bits are used
+ * @output Morton code, x in the even bits and y in the odd bits
+ */
+inline uint32_t morton2d(uint32_t x, uint32_t y) {
+  return mortonSpread(x) | (mortonSpread(y) << 1);
+}
+
+/**
+ * Morton code of a point, quantized on a 65536 x 65536 grid over a
+ *   bounding box.
+ * @param (x,y) Point [m]
+ * @param (min_x,min_y) Lower corner of the box [m]
+ * @param scale Grid cells per meter, 65535 / extent of the box
+ */
+inline uint32_t mortonCode(double x, double y, double min_x, double min_y,
+                           double scale) {
+  double gx = (x - min_x) * scale;
+  double gy = (y - min_y) * scale;
+  gx = gx < 0 ? 0 : (gx > 65535 ? 65535 : gx);
+  gy = gy < 0 ? 0 : (gy > 65535 ? 65535 : gy);
+  return morton2d(static_cast<uint32_t>(gx), static_cast<uint32_t>(gy));
+}
+
+#endif  // MORTON_H_
@@ -0,0 +1,93 @@
+/**
+ * nearest_raster.cpp
+ */
+
+#include "nearest_raster.h"
+
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+using std::vector;
+
+namespace {
+
+// Edge of the blocks the grid is first cut into [cells]
+const int kTopBlock = 64;
+
+// Margin on the distance test covering the float precision of the index [m]
+const double kDistanceSlack = 1e-3;
+
+}  // namespace
+
+const int32_t NearestRaster::kAmbiguous;
+
+void NearestRaster::build(const LandmarkIndex &index, double min_x, double min_y,
+                          double max_x, double max_y, double resolution) {
+  clear();
+  if (index.empty() || !(resolution > 0) || max_x <= min_x || max_y <= min_y) {
+    return;
+  }
+  this->resolution = resolution;
+  inv_resolution = 1 / resolution;
+  this->min_x = min_x;
+  this->min_y = min_y;
+  cells_x = static_cast<int>(ceil((max_x - min_x) * inv_resolution));
+  cells_y = static_cast<int>(ceil((max_y - min_y) * inv_resolution));
+  cells = std::make_shared<vector<int32_t> >(static_cast<size_t>(cells_x) * cells_y, kAmbiguous);
+
+  for (int y0 = 0; y0 < cells_y; y0 += kTopBlock) {
+    for (int x0 = 0; x0 < cells_x; x0 += kTopBlock) {
+      fillBlock(index, x0, y0, std::min(kTopBlock, cells_x - x0),
+                std::min(kTopBlock, cells_y - y0));
+    }
+  }
+}
+
+void NearestRaster::fillBlock(const LandmarkIndex &index, int x0, int y0,
+                              int w, int h) {
+  int first;
+  double first_dist, second_dist;
+  index.nearestTwo(min_x + (x0 + 0.5 * w) * resolution,
+                   min_y + (y0 + 0.5 * h) * resolution,
+                   first, first_dist, second_dist);
+  double diagonal = resolution * sqrt(static_cast<double>(w * w + h * h));
+  if (second_dist - first_dist > diagonal + kDistanceSlack) {
+    for (int y = y0; y < y0 + h; ++y) {
+      std::fill(cells->begin() + static_cast<size_t>(y) * cells_x + x0,
+                cells->begin() + static_cast<size_t>(y) * cells_x + x0 + w, first);
+    }
+    return;
+  }
+  if (w == 1 && h == 1) {
+    ++ambiguous;
+    return;
+  }
+
+  int w1 = (w + 1) / 2, h1 = (h + 1) / 2;
+  fillBlock(index, x0, y0, w1, h1);
+  if (w > w1) {
+    fillBlock(index, x0 + w1, y0, w - w1, h1);
+  }
+  if (h > h1) {
+    fillBlock(index, x0, y0 + h1, w1, h - h1);
+    if (w > w1) {
+      fillBlock(index, x0 + w1, y0 + h1, w - w1, h - h1);
+    }
+  }
+}
+
+void NearestRaster::remap(const vector<int> &new_position) {
+  if (!cells) {
+    return;
+  }
+  if (!cells.unique()) {
+    cells = std::make_shared<vector<int32_t> >(*cells);
+  }
+  vector<int32_t> &grid = *cells;
+  for (size_t i = 0; i < grid.size(); ++i) {
+    if (grid[i] != kAmbiguous) {
+      grid[i] = new_position[grid[i]];
+    }
+  }
+}
@@ -0,0 +1,118 @@
+/**
+ * nearest_raster.h
+ * Precomputed nearest-landmark lookup on a regular grid (a discrete
+ *   Voronoi diagram of the landmarks).
+ *
+ * Every cell stores the landmark closest to all of its points, so the
+ *   association becomes one array read. A cell crossed by a boundary
+ *   between two Voronoi regions has no single answer; it is marked
+ *   ambiguous and the caller falls back to an exact search there.
+ *
+ * A cell is filled when, at its center, the second closest landmark is
+ *   farther than the closest by more than the cell diagonal: moving
+ *   anywhere within the cell changes each distance by at most half the
+ *   diagonal, so the closest landmark cannot change. Large blocks passing
+ *   the same test are filled at once, and only blocks near boundaries are
+ *   split down to single cells.
+ *
+ * The cells are shared between copies of a raster, so copying a map for
+ *   an edit does not copy the grid; remap copies them first
+ *   if they are shared.
+ */
+
+#ifndef NEAREST_RASTER_H_
+#define NEAREST_RASTER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include "landmark_index.h"
+
+class NearestRaster {
+ public:
+  // Cell value of a cell, or a point outside the raster, without a
+  //   single nearest landmark
+  static const int32_t kAmbiguous = -1;
+
+  NearestRaster() : resolution(0), inv_resolution(0), min_x(0), min_y(0),
+                    cells_x(0), cells_y(0), ambiguous(0) {}
+
+  /**
+   * build Computes the nearest landmark of every cell of a grid.
+   * @param index Index over the landmarks
+   * @param (min_x, min_y, max_x, max_y) Area covered by the grid [m]
+   * @param resolution Edge of a cell [m]
+   */
+  void build(const LandmarkIndex &index, double min_x, double min_y,
+             double max_x, double max_y, double resolution);
+
+  /**
+   * lookup Returns the landmark closest to a point.
+   * @param (x,y) Query point in map coordinates [m]
+   * @output Position of the landmark in Map::landmark_list, or kAmbiguous
+   *   if the point is near a Voronoi boundary or outside the grid
+   */
+  int lookup(double x, double y) const {
+    double cx = (x - min_x) * inv_resolution;
+    double cy = (y - min_y) * inv_resolution;
+    if (!(cx >= 0 && cy >= 0 && cx < cells_x && cy < cells_y)) {
+      return kAmbiguous;
+    }
+    return (*cells)[static_cast<size_t>(cy) * cells_x + static_cast<size_t>(cx)];
+  }
+
+  /**
+   * remap Follows a reordering of the landmarks.
+   * @param new_position New position of each landmark, by old position
+   */
+  void remap(const std::vector<int> &new_position);
+
+  void clear() {
+    cells.reset();
+    cells_x = cells_y = 0;
+    ambiguous = 0;
+  }
+
+  bool empty() const {
+    return !cells || cells->empty();
+  }
+
+  /**
+   * ambiguousCells Returns the number of cells that need an exact search.
+   */
+  size_t ambiguousCells() const {
+    return ambiguous;
+  }
+
+  size_t cellCount() const {
+    return cells ? cells->size() : 0;
+  }
+
+  /**
+   * memoryBytes Returns the heap memory used by the grid, shared with the
+   *   copies of the raster.
+   */
+  size_t memoryBytes() const {
+    return cells ? cells->capacity() * sizeof(int32_t) : 0;
+  }
+
+ private:
+  // Fills a block of cells with one landmark if it has a single nearest
+  //   one, otherwise splits it in four
+  void fillBlock(const LandmarkIndex &index, int x0, int y0, int w, int h);
+
+  double resolution;      // Edge of a cell [m]
+  double inv_resolution;
+  double min_x;           // Corner of cell 0 [m]
+  double min_y;
+  int cells_x;            // Grid size in cells
+  int cells_y;
+  size_t ambiguous;       // Cells marked kAmbiguous
+
+  // Nearest landmark of each cell, row-major; shared between copies and
+  //   never changed while shared
+  std::shared_ptr<std::vector<int32_t> > cells;
+};
+
+#endif  // NEAREST_RASTER_H_
@@ -7,6 +7,7 @@
 
 #include "particle_filter.h"
 
+#include <float.h>
 #include <math.h>
 #include <algorithm>
 #include <iostream>
@@ -14,9 +15,11 @@
 #include <numeric>
 #include <random>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "helper_functions.h"
+#include "morton.h"
 
 using std::string;
 using std::vector;
@@ -24,6 +27,143 @@ using std::normal_distribution;
 using std::cout;
 using std::endl;
 
+namespace {
+
+// 99% quantiles of the chi-square distribution with 2 and 3 degrees of
+//   freedom, the gates on innovations and on particles
+const double kChiSquare2 = 9.21;
+const double kChiSquare3 = 11.34;
+
+// Inverts a symmetric 3x3 matrix, returns false if it is singular
+bool invert3(const double m[9], double inv[9]) {
+  inv[0] = m[4] * m[8] - m[5] * m[7];
+  inv[1] = m[2] * m[7] - m[1] * m[8];
+  inv[2] = m[1] * m[5] - m[2] * m[4];
+  double det = m[0] * inv[0] + m[3] * inv[1] + m[6] * inv[2];
+  if (!(fabs(det) > 1e-300)) {
+    return false;
+  }
+  inv[3] = inv[1];
+  inv[4] = m[0] * m[8] - m[2] * m[6];
+  inv[5] = m[2] * m[3] - m[0] * m[5];
+  inv[6] = inv[2];
+  inv[7] = inv[5];
+  inv[8] = m[0] * m[4] - m[1] * m[3];
+  for (int i = 0; i < 9; ++i) {
+    inv[i] /= det;
+  }
+  return true;
+}
+
+// Cholesky factor l (lower, row-major) of a symmetric 3x3 matrix;
+//   directions without positive variance get a zero column
+void cholesky3(const double a[9], double l[9]) {
+  for (int i = 0; i < 9; ++i) {
+    l[i] = 0;
+  }
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j <= i; ++j) {
+      double sum = a[3 * i + j];
+      for (int k = 0; k < j; ++k) {
+        sum -= l[3 * i + k] * l[3 * j + k];
+      }
+      l[3 * i + j] = i == j ? sqrt(std::max(sum, 0.0)) : (l[4 * j] > 0 ? sum / l[4 * j] : 0);
+    }
+  }
+}
+
+// Applies one landmark observation to a Gaussian pose with an extended
+//   Kalman filter step
+// @param pose Mean (x, y, theta), updated in place
+// @param cov Row-major covariance of the pose, updated in place
+// @param observation Observation in vehicle coordinates
+// @param (landmark_x,landmark_y) Associated landmark
+// @param var_x, var_y Observation noise variances
+// @param gate Largest normalized innovation squared that is applied
+// @output Normalized innovation squared, 0 if the innovation covariance
+//   is singular (then nothing is applied)
+double observeGaussian(double pose[3], double cov[9], const LandmarkObs &observation,
+                       double landmark_x, double landmark_y, double var_x,
+                       double var_y, double gate) {
+  // Expected observation in vehicle coordinates, and its Jacobian H
+  double c = cos(pose[2]), s = sin(pose[2]);
+  double dx = landmark_x - pose[0], dy = landmark_y - pose[1];
+  double hx = c * dx + s * dy;
+  double hy = -s * dx + c * dy;
+  double h[6] = {-c, -s, hy, s, -c, -hx};
+  
+  // P H^T (3x2) and the innovation covariance S = H P H^T + R
+  double pht[6];
+  for (int i = 0; i < 3; ++i) {
+    for (int r = 0; r < 2; ++r) {
+      pht[2 * i + r] = cov[3 * i] * h[3 * r] + cov[3 * i + 1] * h[3 * r + 1]
+                       + cov[3 * i + 2] * h[3 * r + 2];
+    }
+  }
+  double s00 = h[0] * pht[0] + h[1] * pht[2] + h[2] * pht[4] + var_x;
+  double s01 = h[0] * pht[1] + h[1] * pht[3] + h[2] * pht[5];
+  double s11 = h[3] * pht[1] + h[4] * pht[3] + h[5] * pht[5] + var_y;
+  double det = s00 * s11 - s01 * s01;
+  if (!(det > 0)) {
+    return 0;
+  }
+  double i00 = s11 / det, i01 = -s01 / det, i11 = s00 / det;
+  
+  // Gate the innovation on its normalized square
+  double nu_x = observation.x - hx, nu_y = observation.y - hy;
+  double nis = nu_x * (i00 * nu_x + i01 * nu_y) + nu_y * (i01 * nu_x + i11 * nu_y);
+  if (nis > gate) {
+    return nis;
+  }
+  
+  // K = P H^T S^-1, x += K nu, P -= K S K^T
+  double k[6];
+  for (int i = 0; i < 3; ++i) {
+    k[2 * i] = pht[2 * i] * i00 + pht[2 * i + 1] * i01;
+    k[2 * i + 1] = pht[2 * i] * i01 + pht[2 * i + 1] * i11;
+  }
+  for (int i = 0; i < 3; ++i) {
+    pose[i] += k[2 * i] * nu_x + k[2 * i + 1] * nu_y;
+  }
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      // (K S K^T)_ij = (K S)_i . K_j, and K S = P H^T
+      cov[3 * i + j] -= pht[2 * i] * k[2 * j] + pht[2 * i + 1] * k[2 * j + 1];
+    }
+  }
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < i; ++j) {
+      cov[3 * i + j] = cov[3 * j + i] = 0.5 * (cov[3 * i + j] + cov[3 * j + i]);
+    }
+  }
+  return nis;
+}
+
+// Noiseless motion over the first t seconds of a sequence of controls,
+//   as a pose relative to the vehicle at its start; false if the controls
+//   last less than t
+bool motionOver(const vector<control_step_s> &controls, double t,
+                double &x, double &y, double &theta) {
+  x = y = theta = 0;
+  for (size_t c = 0; c < controls.size() && t > 1e-9; ++c) {
+    const control_step_s &u = controls[c];
+    double dt = std::min(t, u.delta_t);
+    if (u.yawrate == 0) {
+      x += u.velocity * dt * cos(theta);
+      y += u.velocity * dt * sin(theta);
+    } else {
+      double theta_next = theta + u.yawrate * dt;
+      x += u.velocity * ( sin(theta_next) - sin(theta) ) / u.yawrate;
+      y += u.velocity * ( -cos(theta_next) + cos(theta) ) / u.yawrate;
+      theta = theta_next;
+    }
+    t -= dt;
+  }
+  return t <= 1e-9;
+}
+
+}  // namespace
+
 void ParticleFilter::init(double x, double y, double theta, double std[]) {
   /**
    * Set the number of particles. Initialize all particles to
@@ -33,14 +173,23 @@ void ParticleFilter::init(double x, double y, double theta, double std[]) {
    * NOTE: Consult particle_filter.h for more information about this method 
    *   (and others in this file).
    */
-  num_particles = 100;  // Set the number of particles
+  particles.clear();
+  is_collapsed = false;
+  noise_pending = false;
+  collapse_streak = 0;
+  expand_streak = 0;
   
   // Create random generator
   std::default_random_engine gen;
   
+  // Keep the particles relative to the initial position rounded to the
+  //   kilometre, as maps are to their first landmark
+  origin_x = 1000.0 * floor(x / 1000.0 + 0.5);
+  origin_y = 1000.0 * floor(y / 1000.0 + 0.5);
+  
   // Create normal (Gaussian) distributions for x,y and theta
-  normal_distribution<double> dist_x(x, std[0]);
-  normal_distribution<double> dist_y(y, std[1]);
+  normal_distribution<double> dist_x(x - origin_x, std[0]);
+  normal_distribution<double> dist_y(y - origin_y, std[1]);
   normal_distribution<double> dist_theta(theta, std[2]);
   
   // Initialize particles around gps location with normal distribution with weight = 1
@@ -68,6 +217,19 @@ void ParticleFilter::prediction(double delta_t, double std_pos[],
    *  http://en.cppreference.com/w/cpp/numeric/random/normal_distribution
    *  http://www.cplusplus.com/reference/random/default_random_engine/
    */
+  if (is_collapsed) {
+    control_step_s control{velocity, yaw_rate, delta_t};
+    predictKalman(control, std_pos, true);
+    std::copy(std_pos, std_pos + 3, process_std);
+    advance(control, true);
+    return;
+  }
+  
+  // Noise left over from a prediction without update
+  if (noise_pending) {
+    drawProcessNoise();
+  }
+  
   // Create random generator
   std::default_random_engine gen;
   
@@ -87,6 +249,14 @@ void ParticleFilter::prediction(double delta_t, double std_pos[],
       theta += yaw_rate * delta_t;
     }
     
+    // The optimal proposal draws the noise with the observations
+    if (proposal == kProposalOptimal) {
+      particles[i].x = x;
+      particles[i].y = y;
+      particles[i].theta = theta;
+      continue;
+    }
+    
     // Create normal (Gaussian) distributions for x,y and theta
     normal_distribution<double> dist_x(x, std_pos[0]);
     normal_distribution<double> dist_y(y, std_pos[1]);
@@ -97,6 +267,86 @@ void ParticleFilter::prediction(double delta_t, double std_pos[],
     particles[i].y = dist_y(gen);
     particles[i].theta = dist_theta(gen);
   }
+  
+  std::copy(std_pos, std_pos + 3, process_std);
+  noise_pending = proposal == kProposalOptimal;
+  advance(control_step_s{velocity, yaw_rate, delta_t}, true);
+}
+
+void ParticleFilter::predictionBatch(const vector<control_step_s> &controls,
+                                     double std_pos[]) {
+  if (controls.empty()) {
+    return;
+  }
+  if (is_collapsed) {
+    for (size_t k = 0; k < controls.size(); ++k) {
+      predictKalman(controls[k], std_pos, k + 1 == controls.size());
+    }
+    std::copy(std_pos, std_pos + 3, process_std);
+    for (size_t k = 0; k < controls.size(); ++k) {
+      advance(controls[k], k + 1 == controls.size());
+    }
+    return;
+  }
+  if (noise_pending) {
+    drawProcessNoise();
+  }
+  
+  // Create random generator
+  std::default_random_engine gen;
+  normal_distribution<double> noise_x(0, std_pos[0]);
+  normal_distribution<double> noise_y(0, std_pos[1]);
+  normal_distribution<double> noise_theta(0, std_pos[2]);
+  
+  for (int i = 0; i < num_particles; ++i) {
+    double x = particles[i].x;
+    double y = particles[i].y;
+    double theta = particles[i].theta;
+    
+    // chain the motion model through every control
+    for (const control_step_s &u : controls) {
+      if (u.yawrate == 0) {
+        x += u.velocity * cos(theta) * u.delta_t;
+        y += u.velocity * sin(theta) * u.delta_t;
+      } else {
+        double theta_next = theta + u.yawrate * u.delta_t;
+        x += u.velocity * ( sin(theta_next) - sin(theta) ) / u.yawrate;
+        y += u.velocity * ( -cos(theta_next) + cos(theta) ) / u.yawrate;
+        theta = theta_next;
+      }
+    }
+    
+    // Add the noise of the whole sequence at once, or leave it to the
+    //   optimal proposal
+    if (proposal == kProposalOptimal) {
+      particles[i].x = x;
+      particles[i].y = y;
+      particles[i].theta = theta;
+    } else {
+      particles[i].x = x + noise_x(gen);
+      particles[i].y = y + noise_y(gen);
+      particles[i].theta = theta + noise_theta(gen);
+    }
+  }
+  
+  std::copy(std_pos, std_pos + 3, process_std);
+  noise_pending = proposal == kProposalOptimal;
+  for (size_t k = 0; k < controls.size(); ++k) {
+    advance(controls[k], k + 1 == controls.size());
+  }
+}
+
+void ParticleFilter::advance(const control_step_s &control, bool noise_drawn) {
+  if (replaying) {
+    return;
+  }
+  filter_time += control.delta_t;
+  last_control = control;
+  if (history.size() > 0) {
+    HistoryEntry &entry = history.back(0);
+    entry.controls.push_back(control);
+    entry.noise_after.push_back(noise_drawn);
+  }
 }
 
 int ParticleFilter::dataAssociation(LandmarkObs observation, const Map &map_landmarks) {
@@ -108,6 +358,36 @@ int ParticleFilter::dataAssociation(LandmarkObs observation, const Map &map_land
    *   probably find it useful to implement this method and use it as a helper 
    *   during the updateWeights phase.
    */
+  // The map structures are relative to the map origin
+  observation.x += origin_x - map_landmarks.origin_x;
+  observation.y += origin_y - map_landmarks.origin_y;
+  
+  // Search only the landmarks of the observed class when it is known and
+  //   the map has indexed landmarks of that class
+  if (observation.class_i > 0) {
+    int nearest = map_landmarks.nearestOfClass(observation.x, observation.y,
+                                               observation.class_i);
+    if (nearest >= 0) {
+      return nearest;
+    }
+  }
+  
+  // Away from Voronoi boundaries the raster knows the nearest landmark
+  if (!map_landmarks.raster.empty()) {
+    int nearest = map_landmarks.raster.lookup(observation.x, observation.y);
+    if (nearest != NearestRaster::kAmbiguous) {
+      return nearest;
+    }
+  }
+  
+  // Use the compact map or the spatial index when the map has one
+  if (!map_landmarks.compact.empty()) {
+    return map_landmarks.compact.nearest(observation.x, observation.y);
+  }
+  if (!map_landmarks.index.empty()) {
+    return map_landmarks.index.nearest(observation.x, observation.y);
+  }
+  
   int closest_landmark_id = 0;
   int min_dist = 999999;
   double curr_dist;
@@ -129,6 +409,78 @@ int ParticleFilter::dataAssociation(LandmarkObs observation, const Map &map_land
   return closest_landmark_id;
 }
 
+int ParticleFilter::refinePose(double &x, double &y, double &theta,
+                               const double std_landmark[],
+                               const vector<LandmarkObs> &observations,
+                               const Map &map_landmarks, const double *prior_cov,
+                               int iterations) {
+  double inv_var_x = 1 / (std_landmark[0] * std_landmark[0]);
+  double inv_var_y = 1 / (std_landmark[1] * std_landmark[1]);
+  double pose[3] = {x, y, theta};
+  double prior_info[9];
+  if (prior_cov && !invert3(prior_cov, prior_info)) {
+    prior_cov = NULL;
+  }
+  int used = 0;
+  for (int iteration = 0; iteration < iterations; ++iteration) {
+    // Normal equations J^T W J delta = -J^T W r of the residuals
+    //   r = transformed observation - landmark, plus the prior terms
+    double jtj[9] = {0}, jtr[3] = {0};
+    if (prior_cov) {
+      double d[3] = {pose[0] - x, pose[1] - y, pose[2] - theta};
+      for (int i = 0; i < 9; ++i) {
+        jtj[i] = prior_info[i];
+      }
+      for (int i = 0; i < 3; ++i) {
+        jtr[i] = prior_info[3 * i] * d[0] + prior_info[3 * i + 1] * d[1]
+                 + prior_info[3 * i + 2] * d[2];
+      }
+    }
+    used = 0;
+    double c = cos(pose[2]), s = sin(pose[2]);
+    for (const auto &observation:observations) {
+      LandmarkObs transformed_obs = transform_obs(pose[0], pose[1], pose[2], observation);
+      int id = dataAssociation(transformed_obs, map_landmarks);
+      double landmark_x, landmark_y;
+      landmarkLocal(map_landmarks, id, landmark_x, landmark_y);
+      double r_x = transformed_obs.x - landmark_x;
+      double r_y = transformed_obs.y - landmark_y;
+      if (r_x * r_x + r_y * r_y > kRefineMaxResidual * kRefineMaxResidual) {
+        continue;
+      }
+      ++used;
+      
+      // Rows of J: (1, 0, dx/dtheta) and (0, 1, dy/dtheta)
+      double jx = -s * observation.x - c * observation.y;
+      double jy = c * observation.x - s * observation.y;
+      jtj[0] += inv_var_x;
+      jtj[2] += inv_var_x * jx;
+      jtj[4] += inv_var_y;
+      jtj[5] += inv_var_y * jy;
+      jtj[6] += inv_var_x * jx;
+      jtj[7] += inv_var_y * jy;
+      jtj[8] += inv_var_x * jx * jx + inv_var_y * jy * jy;
+      jtr[0] += inv_var_x * r_x;
+      jtr[1] += inv_var_y * r_y;
+      jtr[2] += inv_var_x * jx * r_x + inv_var_y * jy * r_y;
+    }
+    
+    // Without a prior, two observations are needed to pin down the three
+    //   pose parameters
+    double inv[9];
+    if ((used < 2 && !prior_cov) || !invert3(jtj, inv)) {
+      return used < 2 ? used : 0;
+    }
+    for (int i = 0; i < 3; ++i) {
+      pose[i] -= inv[3 * i] * jtr[0] + inv[3 * i + 1] * jtr[1] + inv[3 * i + 2] * jtr[2];
+    }
+  }
+  x = pose[0];
+  y = pose[1];
+  theta = pose[2];
+  return used;
+}
+
 void ParticleFilter::updateWeights(double sensor_range, double std_landmark[], 
                                    const vector<LandmarkObs> &observations, 
                                    const Map &map_landmarks) {
@@ -145,40 +497,371 @@ void ParticleFilter::updateWeights(double sensor_range, double std_landmark[],
    *   and the following is a good resource for the actual equation to implement
    *   (look at equation 3.33) http://planning.cs.uiuc.edu/node99.html
    */
+  // A collapsed filter updates its Gaussian, unless the observations make
+  //   it expand, in which case the new particles take this update
+  if (is_collapsed) {
+    updateKalman(std_landmark, observations, map_landmarks);
+    if (is_collapsed) {
+      ++filter_stats.kalman_updates;
+      publishKalman();
+      return;
+    }
+  }
+  if (!replaying) {
+    ++filter_stats.particle_updates;
+  }
+  
+  // Record the predicted state of this step, or refresh it on replay
+  if (history.capacity() > 0) {
+    HistoryEntry &entry = replaying ? history.back(replay_back) : history.push();
+    if (!replaying) {
+      entry.stamp = filter_time;
+      entry.observations = observations;
+    }
+    entry.origin_x = origin_x;
+    entry.origin_y = origin_y;
+    entry.x.resize(particles.size());
+    entry.y.resize(particles.size());
+    entry.theta.resize(particles.size());
+    for (size_t i = 0; i < particles.size(); ++i) {
+      entry.x[i] = particles[i].x;
+      entry.y[i] = particles[i].y;
+      entry.theta[i] = particles[i].theta;
+    }
+  }
+  
   // Reset max weight
   max_weight = 0;
   
+  // Running sums for the health metrics
+  double sum_w = 0, sum_w2 = 0, sum_wlogw = 0;
+  double sum_wx = 0, sum_wy = 0, sum_wxx = 0, sum_wyy = 0;
+  double sum_wt = 0, sum_wxy = 0, sum_wxt = 0, sum_wyt = 0, sum_wtt = 0;
+  
+  // Moments are accumulated relative to a reference particle, which keeps
+  //   them accurate at large coordinates and clear of the yaw wrap
+  double x_ref = particles.empty() ? 0 : particles[0].x;
+  double y_ref = particles.empty() ? 0 : particles[0].y;
+  double theta_ref = particles.empty() ? 0 : particles[0].theta;
+  int zero_weights = 0, underflow_weights = 0;
+  
+  // Without a spatial structure to search, associate the observations of
+  //   each chunk of particles in one cache-blocked scan of the landmarks
+  bool blocked_scan = map_landmarks.index.empty() && map_landmarks.compact.empty()
+                      && map_landmarks.raster.empty()
+                      && !map_landmarks.landmark_list.empty();
+  if (blocked_scan) {
+    scan_landmarks.assign(map_landmarks.landmark_list,
+                          map_landmarks.origin_x - origin_x,
+                          map_landmarks.origin_y - origin_y);
+  }
+  
+  // Score whole blocks of particles per observation when there are enough
+  //   of both to fill the lanes
+  bool observation_major = update_order == kObservationMajor
+                           || (update_order == kUpdateOrderAuto
+                               && particles.size() >= kLaneBlockMin
+                               && observations.size() >= kLaneObservationsMin);
+  
+  // Draw the pending process noise from the optimal proposal
+  bool propose = noise_pending;
+  noise_pending = false;
+  if (propose) {
+    ++proposal_seed;
+  }
+  
+  // Weigh the particles in chunks, spread over the worker threads
+  size_t chunk = chunk_size > 0 ? chunk_size : std::max<size_t>(particles.size(), 1);
+  int num_chunks = static_cast<int>((particles.size() + chunk - 1) / chunk);
+  scratch.resize(pool ? pool->threads() : 1);
+  auto weigh_chunk = [&](int c, int worker) {
+    size_t begin = c * chunk;
+    size_t end = std::min(begin + chunk, particles.size());
+    weighParticles(begin, end, std_landmark, observations, map_landmarks,
+                   blocked_scan, observation_major, propose, scratch[worker]);
+  };
+  if (pool) {
+    pool->run(num_chunks, weigh_chunk);
+  } else {
+    for (int c = 0; c < num_chunks; ++c) {
+      weigh_chunk(c, 0);
+    }
+  }
+  
+  // Gather the health metrics of the weighed particles
+  for (const auto &particle:particles) {
+    // update the maximum weight
+    double w = particle.weight;
+    if (w > max_weight) {
+      max_weight = w;
+    }
+    
+    // accumulate the health metrics
+    if (w == 0) {
+      ++zero_weights;
+      continue;
+    }
+    if (w < DBL_MIN) {
+      ++underflow_weights;
+    }
+    sum_w += w;
+    sum_w2 += w * w;
+    sum_wlogw += w * log(w);
+    double dx = particle.x - x_ref;
+    double dy = particle.y - y_ref;
+    double dt = remainder(particle.theta - theta_ref, 2 * M_PI);
+    sum_wx += w * dx;
+    sum_wy += w * dy;
+    sum_wt += w * dt;
+    sum_wxx += w * dx * dx;
+    sum_wyy += w * dy * dy;
+    sum_wtt += w * dt * dt;
+    sum_wxy += w * dx * dy;
+    sum_wxt += w * dx * dt;
+    sum_wyt += w * dy * dt;
+  }
+  
+  filter_stats.highest_weight = max_weight;
+  filter_stats.average_weight = particles.empty() ? 0 : sum_w / particles.size();
+  filter_stats.zero_weights = zero_weights;
+  filter_stats.underflow_weights = underflow_weights;
+  if (sum_w > 0) {
+    // normalized weights p = w / S give H = log(S) - sum(w log w) / S
+    double mean_dx = sum_wx / sum_w;
+    double mean_dy = sum_wy / sum_w;
+    double mean_dt = sum_wt / sum_w;
+    double var = sum_wxx / sum_w - mean_dx * mean_dx
+               + sum_wyy / sum_w - mean_dy * mean_dy;
+    filter_stats.ess = sum_w2 > 0 ? sum_w * sum_w / sum_w2 : 0;
+    filter_stats.entropy = log(sum_w) - sum_wlogw / sum_w;
+    filter_stats.spread = var > 0 ? sqrt(var) : 0;
+    weighted_mean[0] = x_ref + mean_dx;
+    weighted_mean[1] = y_ref + mean_dy;
+    weighted_mean[2] = theta_ref + mean_dt;
+    weighted_cov[0] = sum_wxx / sum_w - mean_dx * mean_dx;
+    weighted_cov[4] = sum_wyy / sum_w - mean_dy * mean_dy;
+    weighted_cov[8] = sum_wtt / sum_w - mean_dt * mean_dt;
+    weighted_cov[1] = weighted_cov[3] = sum_wxy / sum_w - mean_dx * mean_dy;
+    weighted_cov[2] = weighted_cov[6] = sum_wxt / sum_w - mean_dx * mean_dt;
+    weighted_cov[5] = weighted_cov[7] = sum_wyt / sum_w - mean_dy * mean_dt;
+    
+    // Publish the estimate; a replay reaching the newest step corrects the
+    //   estimate already published for it, with the same stamp and step
+    if (!replaying || replay_back == 0) {
+      PoseEstimate estimate;
+      estimate.x = origin_x + x_ref + mean_dx;
+      estimate.y = origin_y + y_ref + mean_dy;
+      estimate.theta = theta_ref + mean_dt;
+      std::copy(weighted_cov, weighted_cov + 9, estimate.cov);
+      estimate.stamp = replaying ? history.back(0).stamp : filter_time;
+      estimate.step = replaying ? update_count : ++update_count;
+      publishEstimate(estimate, replaying);
+      
+      // Collapse once the posterior has looked Gaussian for a while
+      double mean_x = x_ref + mean_dx, mean_y = y_ref + mean_dy;
+      double mean_theta = theta_ref + mean_dt;
+      bool gaussian = hybrid && history.capacity() == 0
+                      && filter_stats.ess >= kCollapseEss
+                      && posteriorIsGaussian(mean_x, mean_y, mean_theta, estimate.cov);
+      collapse_streak = gaussian ? collapse_streak + 1 : 0;
+      if (collapse_streak >= kCollapseSteps) {
+        collapse(mean_x, mean_y, mean_theta, estimate.cov);
+      }
+    }
+  } else {
+    filter_stats.ess = 0;
+    filter_stats.entropy = 0;
+    filter_stats.spread = 0;
+    std::fill(weighted_cov, weighted_cov + 9, 0.0);
+  }
+  
+  // Track the likelihood per observation, so that the averages compare
+  //   across steps seeing different numbers of landmarks, and draw
+  //   particles to inject when it drops
+  injections.clear();
+  if (augmented && !replaying && !is_collapsed && !observations.empty()) {
+    double likelihood = pow(filter_stats.average_weight, 1.0 / observations.size());
+    if (likelihood_slow == 0) {
+      likelihood_slow = likelihood_fast = likelihood;
+    } else {
+      likelihood_slow += kLikelihoodSlow * (likelihood - likelihood_slow);
+      likelihood_fast += kLikelihoodFast * (likelihood - likelihood_fast);
+    }
+    if (likelihood_slow > 0) {
+      drawInjections(std::max(0.0, 1 - likelihood_fast / (kInjectRatio * likelihood_slow)),
+                     observations, map_landmarks);
+    }
+  }
+  
+  // UNCOMMENT TO SEE THIS STEP OF THE FILTER
+//    cout << "Update Weights: " << endl;
+//    for (int k = 0; k < particles.size(); ++k) {
+//      cout << k << "\t" << particles[k].x << "\t" << particles[k].y << "\t" << particles[k].weight << endl;
+//    }
+//    cout << "End of the update" << endl;
+}
+
+void ParticleFilter::weighParticles(size_t begin, size_t end,
+                                    const double std_landmark[],
+                                    const vector<LandmarkObs> &observations,
+                                    const Map &map_landmarks, bool blocked_scan,
+                                    bool observation_major, bool propose,
+                                    WeighScratch &scratch) {
+  if (propose) {
+    proposeParticles(begin, end, std_landmark, observations, map_landmarks, scratch);
+    return;
+  }
+  if (observation_major) {
+    weighObservationMajor(begin, end, std_landmark, observations, map_landmarks,
+                          blocked_scan, scratch);
+    return;
+  }
+  
+  if (blocked_scan) {
+    size_t num_queries = (end - begin) * observations.size();
+    scratch.query_x.resize(num_queries);
+    scratch.query_y.resize(num_queries);
+    scratch.query_landmark.resize(num_queries);
+    size_t query = 0;
+    for (size_t i = begin; i < end; ++i) {
+      const Particle &particle = particles[i];
+      for (const auto &observation:observations) {
+        LandmarkObs transformed_obs = transform_obs(particle.x, particle.y, particle.theta, observation);
+        scratch.query_x[query] = transformed_obs.x;
+        scratch.query_y[query] = transformed_obs.y;
+        ++query;
+      }
+    }
+    nearestLandmarksBlocked(scan_landmarks, scratch.query_x.data(),
+                            scratch.query_y.data(), num_queries,
+                            scratch.query_landmark.data());
+  }
+  size_t query = 0;
+  
   // For each particle transform observations to the map's coordinates
-  for (auto &particle:particles) {
+  for (size_t i = begin; i < end; ++i) {
+    Particle &particle = particles[i];
     particle.weight = 1;
     
     for (auto observation:observations) {
       LandmarkObs transformed_obs = transform_obs(particle.x, particle.y, particle.theta, observation);
       
       // Find out which landmark does it correspond to?
-      int id = dataAssociation(transformed_obs, map_landmarks);
+      int id = blocked_scan ? scratch.query_landmark[query++]
+                            : dataAssociation(transformed_obs, map_landmarks);
       
       // With what probability?
+      double landmark_x, landmark_y;
+      landmarkLocal(map_landmarks, id, landmark_x, landmark_y);
       double weight_part = normPdf2d(transformed_obs.x, transformed_obs.y,
-                                     map_landmarks.landmark_list[id].x_f, map_landmarks.landmark_list[id].y_f,
+                                     landmark_x, landmark_y,
                                      std_landmark[0], std_landmark[1]);
       
       // Accumulate the resulting weight
       particle.weight *= weight_part;
     }
-    
-    // update the maximum weight
-    if (particle.weight > max_weight) {
-      max_weight = particle.weight;
+  }
+}
+
+void ParticleFilter::weighObservationMajor(size_t begin, size_t end,
+                                           const double std_landmark[],
+                                           const vector<LandmarkObs> &observations,
+                                           const Map &map_landmarks,
+                                           bool blocked_scan,
+                                           WeighScratch &scratch) {
+  // log of normPdf2d = log_norm - 0.5 (dx^2 / var_x + dy^2 / var_y)
+  double log_norm = -log(2 * M_PI * std_landmark[0] * std_landmark[1]);
+  double half_inv_var_x = 0.5 / (std_landmark[0] * std_landmark[0]);
+  double half_inv_var_y = 0.5 / (std_landmark[1] * std_landmark[1]);
+  
+  scratch.lane_x.resize(kLaneBlock);
+  scratch.lane_y.resize(kLaneBlock);
+  scratch.lane_cos.resize(kLaneBlock);
+  scratch.lane_sin.resize(kLaneBlock);
+  scratch.lane_tx.resize(kLaneBlock);
+  scratch.lane_ty.resize(kLaneBlock);
+  scratch.lane_lx.resize(kLaneBlock);
+  scratch.lane_ly.resize(kLaneBlock);
+  scratch.lane_logw.resize(kLaneBlock);
+  scratch.lane_landmark.resize(kLaneBlock);
+  double *x = scratch.lane_x.data(), *y = scratch.lane_y.data();
+  double *c = scratch.lane_cos.data(), *s = scratch.lane_sin.data();
+  double *tx = scratch.lane_tx.data(), *ty = scratch.lane_ty.data();
+  double *lx = scratch.lane_lx.data(), *ly = scratch.lane_ly.data();
+  double *logw = scratch.lane_logw.data();
+  int *landmark = scratch.lane_landmark.data();
+  
+  // Without a spatial structure, associate the observations of the whole
+  //   chunk in one cache-blocked scan, as the particle-major path does,
+  //   rather than a scan per block of lanes. Queries are stored by
+  //   observation, then particle
+  size_t num_chunk = end - begin;
+  if (blocked_scan) {
+    size_t num_queries = num_chunk * observations.size();
+    scratch.query_x.resize(num_queries);
+    scratch.query_y.resize(num_queries);
+    scratch.query_landmark.resize(num_queries);
+    for (size_t i = 0; i < num_chunk; ++i) {
+      const Particle &particle = particles[begin + i];
+      double pc = cos(particle.theta), ps = sin(particle.theta);
+      for (size_t j = 0; j < observations.size(); ++j) {
+        double ox = observations[j].x, oy = observations[j].y;
+        scratch.query_x[j * num_chunk + i] = particle.x + pc * ox - ps * oy;
+        scratch.query_y[j * num_chunk + i] = particle.y + ps * ox + pc * oy;
+      }
     }
+    nearestLandmarksBlocked(scan_landmarks, scratch.query_x.data(),
+                            scratch.query_y.data(), num_queries,
+                            scratch.query_landmark.data());
   }
   
-  // UNCOMMENT TO SEE THIS STEP OF THE FILTER
-//    cout << "Update Weights: " << endl;
-//    for (int k = 0; k < particles.size(); ++k) {
-//      cout << k << "\t" << particles[k].x << "\t" << particles[k].y << "\t" << particles[k].weight << endl;
-//    }
-//    cout << "End of the update" << endl;
+  for (size_t first = begin; first < end; first += kLaneBlock) {
+    int lanes = static_cast<int>(std::min(end - first, static_cast<size_t>(kLaneBlock)));
+    for (int i = 0; i < lanes; ++i) {
+      const Particle &particle = particles[first + i];
+      x[i] = particle.x;
+      y[i] = particle.y;
+      c[i] = cos(particle.theta);
+      s[i] = sin(particle.theta);
+      logw[i] = 0;
+    }
+    
+    for (size_t j = 0; j < observations.size(); ++j) {
+      const LandmarkObs &observation = observations[j];
+      double ox = observation.x, oy = observation.y;
+      for (int i = 0; i < lanes; ++i) {
+        tx[i] = x[i] + c[i] * ox - s[i] * oy;
+        ty[i] = y[i] + s[i] * ox + c[i] * oy;
+      }
+      
+      // The association is a search and stays scalar
+      if (blocked_scan) {
+        const int *found = scratch.query_landmark.data() + j * num_chunk
+                           + (first - begin);
+        std::copy(found, found + lanes, landmark);
+      } else {
+        LandmarkObs transformed_obs = observation;
+        for (int i = 0; i < lanes; ++i) {
+          transformed_obs.x = tx[i];
+          transformed_obs.y = ty[i];
+          landmark[i] = dataAssociation(transformed_obs, map_landmarks);
+        }
+      }
+      for (int i = 0; i < lanes; ++i) {
+        landmarkLocal(map_landmarks, landmark[i], lx[i], ly[i]);
+      }
+      
+      for (int i = 0; i < lanes; ++i) {
+        double dx = tx[i] - lx[i];
+        double dy = ty[i] - ly[i];
+        logw[i] += log_norm - (dx * dx * half_inv_var_x + dy * dy * half_inv_var_y);
+      }
+    }
+    
+    for (int i = 0; i < lanes; ++i) {
+      particles[first + i].weight = exp(logw[i]);
+    }
+  }
 }
 
 void ParticleFilter::resample() {
@@ -188,28 +871,690 @@ void ParticleFilter::resample() {
    * NOTE: You may find std::discrete_distribution helpful here.
    *   http://en.cppreference.com/w/cpp/numeric/random/discrete_distribution
    */
+  // A collapsed filter has nothing to resample
+  if (is_collapsed) {
+    return;
+  }
+  
   // Create random generator stuff
   std::default_random_engine gen;
-  std::uniform_real_distribution<> rand_beta(0, max_weight);
-  std::discrete_distribution<> rand_index(0, num_particles);
   std::vector<Particle> resampled_particles;
   
+  // Marks parents already picked, to count the unique ancestors
+  std::vector<char> picked(num_particles, 0);
+  ancestors.resize(num_particles);
+  int unique_ancestors = 0;
   
-  int index = rand_index(gen);
-  double b = 0;
+  if (resampler == kResampleSystematic) {
+    double total = 0;
+    for (int i = 0; i < num_particles; ++i) {
+      total += particles[i].weight;
+    }
+    
+    // Pick at offset, offset + step, offset + 2 step, ... along the
+    //   cumulative weights; keep the particles if they all weigh nothing
+    double step = total / num_particles;
+    std::uniform_real_distribution<> rand_offset(0, step);
+    double pointer = total > 0 ? rand_offset(gen) : 0;
+    double cumulative = num_particles > 0 ? particles[0].weight : 0;
+    int index = 0;
+    for (int i = 0; i < num_particles; ++i) {
+      if (total > 0) {
+        while (pointer > cumulative && index < num_particles - 1) {
+          cumulative += particles[++index].weight;
+        }
+        pointer += step;
+      } else {
+        index = i;
+      }
+      ancestors[i] = index;
+      
+      if (!picked[index]) {
+        picked[index] = 1;
+        ++unique_ancestors;
+      }
+    }
+  } else {
+    std::uniform_real_distribution<> rand_beta(0, max_weight);
+    std::discrete_distribution<> rand_index(0, num_particles);
+    int index = rand_index(gen);
+    double b = 0;
+    
+    // Resampling wheel algorithm
+    for (int i = 0; i < num_particles; ++i) {
+      b += rand_beta(gen);
+      
+      while (b > particles[index].weight) {
+        b = b - particles[index].weight;
+        index = (index + 1) % num_particles;
+      }
+      ancestors[i] = index;
+      
+      if (!picked[index]) {
+        picked[index] = 1;
+        ++unique_ancestors;
+      }
+    }
+  }
   
-  // Resampling wheel algorithm
-  for (int i = 0; i < num_particles; ++i) {
-    b += rand_beta(gen);
+  // Order the picks by the Morton code of their parent, so consecutive
+  //   particles query nearby landmarks in the next update
+  if (spatial_sort && num_particles > 1) {
+    double min_x = particles[0].x, max_x = min_x;
+    double min_y = particles[0].y, max_y = min_y;
+    for (int i = 1; i < num_particles; ++i) {
+      min_x = std::min(min_x, particles[i].x);
+      max_x = std::max(max_x, particles[i].x);
+      min_y = std::min(min_y, particles[i].y);
+      max_y = std::max(max_y, particles[i].y);
+    }
+    double extent = std::max(max_x - min_x, max_y - min_y);
+    double scale = extent > 0 ? 65535 / extent : 0;
     
-    while (b > particles[index].weight) {
-      b = b - particles[index].weight;
-      index = (index + 1) % num_particles;
+    vector<std::pair<uint32_t, int> > order(num_particles);
+    for (int i = 0; i < num_particles; ++i) {
+      const Particle &parent = particles[ancestors[i]];
+      order[i].first = mortonCode(parent.x, parent.y, min_x, min_y, scale);
+      order[i].second = ancestors[i];
+    }
+    std::sort(order.begin(), order.end());
+    for (int i = 0; i < num_particles; ++i) {
+      ancestors[i] = order[i].second;
     }
-    resampled_particles.push_back(particles[index]);
   }
   
+  // Gather the picked parents
+  resampled_particles.reserve(num_particles);
+  for (int i = 0; i < num_particles; ++i) {
+    resampled_particles.push_back(particles[ancestors[i]]);
+  }
+  
+  // Regularize: shrink each particle towards the mean by a and move it
+  //   by h L z, L the Cholesky factor of the weighted covariance (with
+  //   its small-sample bias ESS / (ESS - 1) removed) and z standard
+  //   normal. The draws go to arrays first, so that the update is one
+  //   branch-free pass over the particles. The injected particles are
+  //   placed afterwards, so they are not pulled back towards the mean
+  //   they are meant to escape
+  if (regularized && num_particles > 1 && filter_stats.ess > 1) {
+    double l[9];
+    cholesky3(weighted_cov, l);
+    double h = pow(4.0 / (5.0 * num_particles), 1.0 / 7);
+    double a = sqrt(1 - h * h);
+    double bias = sqrt(filter_stats.ess / (filter_stats.ess - 1));
+    for (int i = 0; i < 9; ++i) {
+      l[i] *= h * bias;
+    }
+    double mx = weighted_mean[0], my = weighted_mean[1], mt = weighted_mean[2];
+    normal_distribution<double> unit(0, 1);
+    std::vector<double> z0(num_particles), z1(num_particles), z2(num_particles);
+    for (int i = 0; i < num_particles; ++i) {
+      z0[i] = unit(jitter_gen);
+      z1[i] = unit(jitter_gen);
+      z2[i] = unit(jitter_gen);
+    }
+    for (int i = 0; i < num_particles; ++i) {
+      Particle &particle = resampled_particles[i];
+      particle.x = mx + a * (particle.x - mx) + l[0] * z0[i];
+      particle.y = my + a * (particle.y - my) + l[3] * z0[i] + l[4] * z1[i];
+      particle.theta = mt + a * remainder(particle.theta - mt, 2 * M_PI)
+                       + l[6] * z0[i] + l[7] * z1[i] + l[8] * z2[i];
+    }
+  }
+  
+  // Put the injected particles in evenly spread slots
+  int num_injected = std::min(static_cast<int>(injections.size()), num_particles);
+  for (int k = 0; k < num_injected; ++k) {
+    int i = static_cast<int>(static_cast<int64_t>(k) * num_particles / num_injected);
+    resampled_particles[i] = injections[k];
+    resampled_particles[i].id = i;
+    ancestors[i] = -1;
+  }
+  injections.clear();
+  
   particles = resampled_particles;
+  filter_stats.unique_ancestors = unique_ancestors;
+  filter_stats.injected = num_injected;
+  
+  if (history.size() > 0) {
+    history.back(replay_back).ancestors = ancestors;
+  }
+}
+
+void ParticleFilter::setProposal(Proposal proposal) {
+  if (noise_pending && proposal != kProposalOptimal) {
+    drawProcessNoise();
+  }
+  this->proposal = proposal;
+}
+
+void ParticleFilter::drawProcessNoise() {
+  // Create random generator
+  std::default_random_engine gen;
+  normal_distribution<double> noise_x(0, process_std[0]);
+  normal_distribution<double> noise_y(0, process_std[1]);
+  normal_distribution<double> noise_theta(0, process_std[2]);
+  for (auto &particle:particles) {
+    particle.x += noise_x(gen);
+    particle.y += noise_y(gen);
+    particle.theta += noise_theta(gen);
+  }
+  noise_pending = false;
+}
+
+void ParticleFilter::proposeParticles(size_t begin, size_t end,
+                                      const double std_landmark[],
+                                      const vector<LandmarkObs> &observations,
+                                      const Map &map_landmarks,
+                                      WeighScratch &scratch) {
+  double var_x = std_landmark[0] * std_landmark[0];
+  double var_y = std_landmark[1] * std_landmark[1];
+  double q[3] = {process_std[0] * process_std[0], process_std[1] * process_std[1],
+                 process_std[2] * process_std[2]};
+  bool noisy = q[0] > 0 && q[1] > 0 && q[2] > 0;
+  double log_prior_norm = noisy ? -0.5 * log(q[0] * q[1] * q[2]) : 0;
+  double log_obs_norm = -log(2 * M_PI * std_landmark[0] * std_landmark[1]);
+  
+  // One generator per chunk, so that the draws do not depend on which
+  //   thread weighs which chunk
+  std::default_random_engine gen(proposal_seed * 2654435761u + static_cast<unsigned>(begin));
+  normal_distribution<double> unit(0, 1);
+  scratch.query_landmark.resize(observations.size());
+  
+  for (size_t i = begin; i < end; ++i) {
+    Particle &particle = particles[i];
+    double prior[3] = {particle.x, particle.y, particle.theta};
+    
+    // Gaussian left of the process noise by the observations, associated
+    //   at the noise-free prediction
+    double pose[3] = {prior[0], prior[1], prior[2]};
+    double cov[9] = {q[0], 0, 0, 0, q[1], 0, 0, 0, q[2]};
+    for (size_t j = 0; j < observations.size(); ++j) {
+      LandmarkObs transformed_obs = transform_obs(prior[0], prior[1], prior[2], observations[j]);
+      int id = dataAssociation(transformed_obs, map_landmarks);
+      scratch.query_landmark[j] = id;
+      double landmark_x, landmark_y;
+      landmarkLocal(map_landmarks, id, landmark_x, landmark_y);
+      if (noisy) {
+        observeGaussian(pose, cov, observations[j], landmark_x, landmark_y,
+                        var_x, var_y, kChiSquare2);
+      }
+    }
+    
+    // Draw from it: x = mean + L z, log q(x) = -z.z / 2 - log det L
+    double log_ratio = 0;
+    if (noisy) {
+      double l[9];
+      cholesky3(cov, l);
+      if (l[0] > 0 && l[4] > 0 && l[8] > 0) {
+        double z[3] = {unit(gen), unit(gen), unit(gen)};
+        particle.x = pose[0] + l[0] * z[0];
+        particle.y = pose[1] + l[3] * z[0] + l[4] * z[1];
+        particle.theta = pose[2] + l[6] * z[0] + l[7] * z[1] + l[8] * z[2];
+        double log_q = -0.5 * (z[0] * z[0] + z[1] * z[1] + z[2] * z[2])
+                       - log(l[0] * l[4] * l[8]);
+        double d[3] = {particle.x - prior[0], particle.y - prior[1],
+                       remainder(particle.theta - prior[2], 2 * M_PI)};
+        double log_p = log_prior_norm
+                       - 0.5 * (d[0] * d[0] / q[0] + d[1] * d[1] / q[1] + d[2] * d[2] / q[2]);
+        log_ratio = log_p - log_q;
+      }
+    }
+    
+    // Importance weight: the likelihood at the drawn pose times the ratio
+    //   of the motion model to the proposal
+    double log_w = log_ratio;
+    for (size_t j = 0; j < observations.size(); ++j) {
+      LandmarkObs transformed_obs = transform_obs(particle.x, particle.y, particle.theta,
+                                                  observations[j]);
+      double landmark_x, landmark_y;
+      landmarkLocal(map_landmarks, scratch.query_landmark[j], landmark_x, landmark_y);
+      double dx = transformed_obs.x - landmark_x;
+      double dy = transformed_obs.y - landmark_y;
+      log_w += log_obs_norm - 0.5 * (dx * dx / var_x + dy * dy / var_y);
+    }
+    particle.weight = exp(log_w);
+  }
+}
+
+void ParticleFilter::setThreads(int threads, size_t chunk_size) {
+  if (threads > 1) {
+    if (!pool || pool->threads() != threads) {
+      pool.reset(new WorkerPool(threads));
+    }
+  } else {
+    pool.reset();
+  }
+  this->chunk_size = chunk_size;
+}
+
+void ParticleFilter::recenter(double x, double y) {
+  double dx = origin_x - x;
+  double dy = origin_y - y;
+  for (auto &particle : particles) {
+    particle.x += dx;
+    particle.y += dy;
+  }
+  ekf_x += dx;
+  ekf_y += dy;
+  origin_x = x;
+  origin_y = y;
+}
+
+void ParticleFilter::setHybrid(bool enable) {
+  hybrid = enable;
+  collapse_streak = 0;
+  expand_streak = 0;
+  if (!enable && is_collapsed) {
+    expand();
+  }
+}
+
+void ParticleFilter::predictKalman(const control_step_s &control,
+                                   const double std_pos[], bool add_noise) {
+  double v = control.velocity, yaw_rate = control.yawrate, dt = control.delta_t;
+  
+  // Motion model of the particles, and its Jacobian in theta
+  double dx_dtheta, dy_dtheta;
+  if (yaw_rate == 0) {
+    ekf_x += v * cos(ekf_theta) * dt;
+    ekf_y += v * sin(ekf_theta) * dt;
+    dx_dtheta = -v * sin(ekf_theta) * dt;
+    dy_dtheta = v * cos(ekf_theta) * dt;
+  } else {
+    double theta_next = ekf_theta + yaw_rate * dt;
+    ekf_x += v * ( sin(theta_next) - sin(ekf_theta) ) / yaw_rate;
+    ekf_y += v * ( -cos(theta_next) + cos(ekf_theta) ) / yaw_rate;
+    dx_dtheta = v * ( cos(theta_next) - cos(ekf_theta) ) / yaw_rate;
+    dy_dtheta = v * ( sin(theta_next) - sin(ekf_theta) ) / yaw_rate;
+    ekf_theta = theta_next;
+  }
+  
+  // P = F P F^T with F = I + dx_dtheta e0 e2^T + dy_dtheta e1 e2^T
+  double *p = ekf_cov;
+  double f[9] = {1, 0, dx_dtheta, 0, 1, dy_dtheta, 0, 0, 1};
+  double fp[9], fpf[9];
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      fp[3 * i + j] = f[3 * i] * p[j] + f[3 * i + 1] * p[3 + j] + f[3 * i + 2] * p[6 + j];
+    }
+  }
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      fpf[3 * i + j] = fp[3 * i] * f[3 * j] + fp[3 * i + 1] * f[3 * j + 1]
+                       + fp[3 * i + 2] * f[3 * j + 2];
+    }
+  }
+  std::copy(fpf, fpf + 9, ekf_cov);
+  
+  // The particles draw the process noise once per prediction call
+  if (add_noise) {
+    ekf_cov[0] += std_pos[0] * std_pos[0];
+    ekf_cov[4] += std_pos[1] * std_pos[1];
+    ekf_cov[8] += std_pos[2] * std_pos[2];
+  }
+  particles.assign(1, Particle{0, ekf_x, ekf_y, ekf_theta, 1});
+}
+
+void ParticleFilter::updateKalman(const double std_landmark[],
+                                  const vector<LandmarkObs> &observations,
+                                  const Map &map_landmarks) {
+  double var_x = std_landmark[0] * std_landmark[0];
+  double var_y = std_landmark[1] * std_landmark[1];
+  double pose[3] = {ekf_x, ekf_y, ekf_theta};
+  int outliers = 0;
+  
+  // Apply the observations one at a time, each to the state updated by
+  //   the ones before
+  for (const auto &observation:observations) {
+    LandmarkObs transformed_obs = transform_obs(pose[0], pose[1], pose[2], observation);
+    int id = dataAssociation(transformed_obs, map_landmarks);
+    double landmark_x, landmark_y;
+    landmarkLocal(map_landmarks, id, landmark_x, landmark_y);
+    if (observeGaussian(pose, ekf_cov, observation, landmark_x, landmark_y,
+                        var_x, var_y, kChiSquare2) > kChiSquare2) {
+      ++outliers;
+    }
+  }
+  ekf_x = pose[0];
+  ekf_y = pose[1];
+  ekf_theta = pose[2];
+  particles.assign(1, Particle{0, ekf_x, ekf_y, ekf_theta, 1});
+  
+  // Observations the Gaussian cannot explain mean another hypothesis
+  bool ambiguous = !observations.empty()
+                   && outliers > kExpandOutliers * observations.size();
+  expand_streak = ambiguous ? expand_streak + 1 : 0;
+  if (expand_streak >= kExpandSteps) {
+    expand();
+  }
+}
+
+bool ParticleFilter::posteriorIsGaussian(double mean_x, double mean_y,
+                                         double mean_theta,
+                                         const double cov[9]) const {
+  double inv[9];
+  if (!invert3(cov, inv)) {
+    return false;
+  }
+  double inside = 0, total = 0;
+  for (const auto &particle:particles) {
+    double d[3] = {particle.x - mean_x, particle.y - mean_y,
+                   remainder(particle.theta - mean_theta, 2 * M_PI)};
+    double m = 0;
+    for (int i = 0; i < 3; ++i) {
+      m += d[i] * (inv[3 * i] * d[0] + inv[3 * i + 1] * d[1] + inv[3 * i + 2] * d[2]);
+    }
+    total += particle.weight;
+    if (m <= kChiSquare3) {
+      inside += particle.weight;
+    }
+  }
+  return total > 0 && inside >= kCollapseInliers * total;
+}
+
+void ParticleFilter::drawInjections(double rate,
+                                    const vector<LandmarkObs> &observations,
+                                    const Map &map_landmarks) {
+  int num_landmarks = static_cast<int>(map_landmarks.compact.empty()
+                                       ? map_landmarks.landmark_list.size()
+                                       : map_landmarks.compact.size());
+  if (rate <= 0 || num_landmarks == 0) {
+    return;
+  }
+  
+  std::default_random_engine &gen = inject_gen;
+  std::binomial_distribution<int> rand_count(num_particles, std::min(rate, 1.0));
+  std::uniform_int_distribution<int> rand_landmark(0, num_landmarks - 1);
+  std::uniform_int_distribution<int> rand_observation(0, static_cast<int>(observations.size()) - 1);
+  std::uniform_real_distribution<double> rand_heading(0, 2 * M_PI / kInjectHeadings);
+  int count = rand_count(gen);
+  
+  for (int k = 0; k < count; ++k) {
+    // Put a random observation on a random landmark
+    const LandmarkObs &anchor = observations[rand_observation(gen)];
+    double anchor_x, anchor_y;
+    landmarkLocal(map_landmarks, rand_landmark(gen), anchor_x, anchor_y);
+    
+    // The observation farthest from the anchor fixes the heading best
+    const LandmarkObs *other = NULL;
+    double other_dist = 0;
+    for (const auto &observation:observations) {
+      double d = dist(observation.x, observation.y, anchor.x, anchor.y);
+      if (d > other_dist) {
+        other = &observation;
+        other_dist = d;
+      }
+    }
+    
+    // Coarse search over the headings for the one putting the other
+    //   observation closest to a landmark
+    double theta = rand_heading(gen);
+    if (other) {
+      double best_theta = theta, best_error = -1;
+      double best_x = 0, best_y = 0;
+      for (int h = 0; h < kInjectHeadings; ++h) {
+        double heading = theta + 2 * M_PI * h / kInjectHeadings;
+        double c = cos(heading), s = sin(heading);
+        double x = anchor_x - (c * anchor.x - s * anchor.y);
+        double y = anchor_y - (s * anchor.x + c * anchor.y);
+        LandmarkObs transformed_obs = transform_obs(x, y, heading, *other);
+        int id = dataAssociation(transformed_obs, map_landmarks);
+        double landmark_x, landmark_y;
+        landmarkLocal(map_landmarks, id, landmark_x, landmark_y);
+        double error = dist(transformed_obs.x, transformed_obs.y, landmark_x, landmark_y);
+        if (best_error < 0 || error < best_error) {
+          best_theta = heading;
+          best_error = error;
+          best_x = landmark_x;
+          best_y = landmark_y;
+        }
+      }
+      
+      // Turn so that the two observations line up with their landmarks
+      theta = atan2(best_y - anchor_y, best_x - anchor_x)
+              - atan2(other->y - anchor.y, other->x - anchor.x);
+      if (best_x == anchor_x && best_y == anchor_y) {
+        theta = best_theta;
+      }
+    }
+    double c = cos(theta), s = sin(theta);
+    injections.push_back(Particle{k, anchor_x - (c * anchor.x - s * anchor.y),
+                                  anchor_y - (s * anchor.x + c * anchor.y), theta, 1});
+  }
+}
+
+void ParticleFilter::collapse(double mean_x, double mean_y, double mean_theta,
+                              const double cov[9]) {
+  ekf_x = mean_x;
+  ekf_y = mean_y;
+  ekf_theta = mean_theta;
+  std::copy(cov, cov + 9, ekf_cov);
+  particles.assign(1, Particle{0, ekf_x, ekf_y, ekf_theta, 1});
+  is_collapsed = true;
+  collapse_streak = 0;
+  expand_streak = 0;
+  ++filter_stats.mode_switches;
+}
+
+void ParticleFilter::expand() {
+  // Cholesky factor of the widened covariance
+  double a[9];
+  std::copy(ekf_cov, ekf_cov + 9, a);
+  for (int i = 0; i < 3; ++i) {
+    a[4 * i] += kExpandStd[i] * kExpandStd[i];
+  }
+  double l[9];
+  cholesky3(a, l);
+  
+  normal_distribution<double> unit(0, 1);
+  particles.clear();
+  for (int i = 0; i < num_particles; ++i) {
+    double z[3] = {unit(jitter_gen), unit(jitter_gen), unit(jitter_gen)};
+    particles.push_back(Particle{i, ekf_x + l[0] * z[0],
+                                 ekf_y + l[3] * z[0] + l[4] * z[1],
+                                 ekf_theta + l[6] * z[0] + l[7] * z[1] + l[8] * z[2], 1});
+  }
+  is_collapsed = false;
+  collapse_streak = 0;
+  expand_streak = 0;
+  noise_pending = false;
+  ++filter_stats.mode_switches;
+}
+
+void ParticleFilter::publishKalman() {
+  filter_stats.highest_weight = 1;
+  filter_stats.average_weight = 1;
+  filter_stats.zero_weights = 0;
+  filter_stats.underflow_weights = 0;
+  filter_stats.ess = 1;
+  filter_stats.entropy = 0;
+  filter_stats.spread = sqrt(std::max(ekf_cov[0] + ekf_cov[4], 0.0));
+  max_weight = 1;
+  
+  PoseEstimate estimate;
+  estimate.x = origin_x + ekf_x;
+  estimate.y = origin_y + ekf_y;
+  estimate.theta = ekf_theta;
+  std::copy(ekf_cov, ekf_cov + 9, estimate.cov);
+  estimate.stamp = filter_time;
+  estimate.step = ++update_count;
+  publishEstimate(estimate);
+}
+
+void ParticleFilter::publishEstimate(const PoseEstimate &estimate, bool amend) {
+  estimate_channel.write(estimate);
+  if (amend) {
+    pose_history.amend(estimate);
+  } else {
+    pose_history.push(estimate, last_control.velocity, last_control.yawrate);
+  }
+}
+
+void ParticleFilter::enableHistory(int capacity, int max_replay_steps) {
+  history.reset(std::max(capacity, smoothing_lag + 1));
+  this->max_replay_steps = max_replay_steps;
+}
+
+void ParticleFilter::enableSmoothing(int lag) {
+  smoothing_lag = lag;
+  if (history.capacity() < lag + 1) {
+    history.reset(lag + 1);
+  }
+}
+
+bool ParticleFilter::smoothedTrajectory(int lag, vector<PoseEstimate> &trajectory) const {
+  trajectory.clear();
+  if (lag < 0 || lag >= history.size()) {
+    return false;
+  }
+  
+  // Line of descent of every current particle, as an index into the
+  //   recorded states; after a resample the copies weigh the same
+  bool resampled = !history.back(0).ancestors.empty();
+  vector<int> lineage(num_particles);
+  vector<double> weights(num_particles);
+  for (int i = 0; i < num_particles; ++i) {
+    lineage[i] = i;
+    weights[i] = resampled ? 1 : particles[i].weight;
+  }
+  
+  trajectory.resize(lag + 1);
+  for (int k = 0; k <= lag; ++k) {
+    const HistoryEntry &entry = history.back(k);
+    
+    // Step back through the resample of step k to the state it picked
+    if (!entry.ancestors.empty()) {
+      for (int i = 0; i < num_particles; ++i) {
+        if (lineage[i] >= 0) {
+          lineage[i] = entry.ancestors[lineage[i]];
+        }
+      }
+    }
+    
+    // Weighted mean and covariance of the ancestors, relative to the first
+    //   of them to keep the precision and the yaw clear of the wrap
+    double x_ref = 0, y_ref = 0, theta_ref = 0;
+    bool found = false;
+    double sum_w = 0, sum_wx = 0, sum_wy = 0, sum_wt = 0;
+    double sum_wxx = 0, sum_wyy = 0, sum_wtt = 0, sum_wxy = 0, sum_wxt = 0, sum_wyt = 0;
+    for (int i = 0; i < num_particles; ++i) {
+      int a = lineage[i];
+      double w = weights[i];
+      if (a < 0 || w <= 0) {
+        continue;
+      }
+      if (!found) {
+        x_ref = entry.x[a];
+        y_ref = entry.y[a];
+        theta_ref = entry.theta[a];
+        found = true;
+      }
+      double x = entry.x[a] - x_ref;
+      double y = entry.y[a] - y_ref;
+      double t = remainder(entry.theta[a] - theta_ref, 2 * M_PI);
+      sum_w += w;
+      sum_wx += w * x;
+      sum_wy += w * y;
+      sum_wt += w * t;
+      sum_wxx += w * x * x;
+      sum_wyy += w * y * y;
+      sum_wtt += w * t * t;
+      sum_wxy += w * x * y;
+      sum_wxt += w * x * t;
+      sum_wyt += w * y * t;
+    }
+    if (sum_w <= 0) {
+      trajectory.clear();
+      return false;
+    }
+    
+    double mean_x = sum_wx / sum_w;
+    double mean_y = sum_wy / sum_w;
+    double mean_t = sum_wt / sum_w;
+    PoseEstimate &pose = trajectory[lag - k];
+    pose.x = entry.origin_x + x_ref + mean_x;
+    pose.y = entry.origin_y + y_ref + mean_y;
+    pose.theta = theta_ref + mean_t;
+    pose.cov[0] = sum_wxx / sum_w - mean_x * mean_x;
+    pose.cov[4] = sum_wyy / sum_w - mean_y * mean_y;
+    pose.cov[8] = sum_wtt / sum_w - mean_t * mean_t;
+    pose.cov[1] = pose.cov[3] = sum_wxy / sum_w - mean_x * mean_y;
+    pose.cov[2] = pose.cov[6] = sum_wxt / sum_w - mean_x * mean_t;
+    pose.cov[5] = pose.cov[7] = sum_wyt / sum_w - mean_y * mean_t;
+    pose.stamp = entry.stamp;
+    pose.step = update_count - k;
+  }
+  return true;
+}
+
+bool ParticleFilter::updateDelayed(double stamp, double sensor_range,
+                                   double std_landmark[],
+                                   const vector<LandmarkObs> &observations,
+                                   const Map &map_landmarks) {
+  // Find the newest recorded step not later than the observations
+  int k = 0;
+  while (k < history.size() && history.back(k).stamp > stamp + 1e-9) {
+    ++k;
+  }
+  if (k == history.size() || k > max_replay_steps) {
+    ++filter_stats.late_dropped;
+    return false;
+  }
+  
+  HistoryEntry &target = history.back(k);
+  
+  // The step is usually earlier than the frame; carry the observations
+  //   back to the vehicle frame at the step along the controls recorded
+  //   since, which weighs every particle as if predicted without noise
+  //   to the time of the frame
+  double move_x, move_y, move_theta;
+  if (!motionOver(target.controls, stamp - target.stamp,
+                  move_x, move_y, move_theta)) {
+    ++filter_stats.late_dropped;
+    return false;
+  }
+  double cos_move = cos(move_theta), sin_move = sin(move_theta);
+  for (size_t i = 0; i < observations.size(); ++i) {
+    LandmarkObs obs = observations[i];
+    obs.x = move_x + cos_move * observations[i].x - sin_move * observations[i].y;
+    obs.y = move_y + sin_move * observations[i].x + cos_move * observations[i].y;
+    target.observations.push_back(obs);
+  }
+  
+  // Restore the predicted state of that step, in the current frame
+  double shift_x = target.origin_x - origin_x;
+  double shift_y = target.origin_y - origin_y;
+  for (int i = 0; i < num_particles; ++i) {
+    particles[i].x = target.x[i] + shift_x;
+    particles[i].y = target.y[i] + shift_y;
+    particles[i].theta = target.theta[i];
+  }
+  noise_pending = proposal == kProposalOptimal;
+  
+  // Replay the update, resample and the following controls of every
+  //   step since then, drawing the noise as the original calls did
+  replaying = true;
+  for (int j = k; j >= 0; --j) {
+    replay_back = j;
+    HistoryEntry &entry = history.back(j);
+    updateWeights(sensor_range, std_landmark, entry.observations, map_landmarks);
+    resample();
+    
+    vector<control_step_s> segment;
+    for (size_t c = 0; c < entry.controls.size(); ++c) {
+      segment.push_back(entry.controls[c]);
+      if (entry.noise_after[c]) {
+        predictionBatch(segment, process_std);
+        segment.clear();
+      }
+    }
+  }
+  replaying = false;
+  replay_back = 0;
+  
+  ++filter_stats.late_applied;
+  return true;
 }
 
 void ParticleFilter::SetAssociations(Particle& particle, 
@@ -9,9 +9,16 @@
 #ifndef PARTICLE_FILTER_H_
 #define PARTICLE_FILTER_H_
 
+#include <memory>
+#include <random>
 #include <string>
 #include <vector>
+#include "blocked_scan.h"
 #include "helper_functions.h"
+#include "pose_history.h"
+#include "seqlock.h"
+#include "state_history.h"
+#include "worker_pool.h"
 
 struct Particle {
   int id;
@@ -24,12 +31,111 @@ struct Particle {
   std::vector<double> sense_y;
 };
 
+/**
+ * Struct holding health metrics of the filter. They are refreshed as a
+ *   by-product of the updateWeights and resample passes, so reading them
+ *   costs nothing.
+ */
+struct FilterStats {
+  double highest_weight;  // Largest particle weight after the update
+  double average_weight;  // Mean particle weight after the update
+  double ess;             // Effective sample size, (sum w)^2 / sum w^2
+  double entropy;         // Entropy of the normalized weights [nats]
+  int zero_weights;       // Particles whose weight is exactly zero
+  int underflow_weights;  // Particles whose weight is subnormal (non-zero)
+  double spread;          // Weighted RMS distance of particles to their mean [m]
+  int unique_ancestors;   // Distinct parents picked by the last resample
+  int late_applied;       // Delayed observation frames applied by replay
+  int late_dropped;       // Delayed observation frames too old to apply, or
+                          //   later than the last prediction
+  int particle_updates;   // Updates run on the particles
+  int kalman_updates;     // Updates run on the collapsed Kalman filter
+  int mode_switches;      // Collapses and re-expansions in hybrid mode
+  int injected;           // Particles injected by the last resample
+};
+
+// Smallest particle and observation counts for which the automatic
+//   update order scores observations across blocks of particles
+const size_t kLaneBlockMin = 32;
+const size_t kLaneObservationsMin = 2;
+
+// Particles scored together by the observation-major update
+const int kLaneBlock = 256;
+
+// Hybrid mode collapses the particles to an extended Kalman filter after
+//   kCollapseSteps updates in a row with a Gaussian-looking posterior: an
+//   effective sample size of at least kCollapseEss particles, and at
+//   least kCollapseInliers of the weight inside the 99% ellipsoid of the
+//   fitted Gaussian. The ESS is an absolute count, as it bounds how well
+//   the covariance is fitted whatever the particle count; 30 samples, 10
+//   per dimension, give about 25% error on the variances. A fraction of
+//   the particles would mostly measure how much sharper the likelihood is
+//   than the cloud, which is high precisely on unimodal posteriors
+const int kCollapseSteps = 3;
+const double kCollapseEss = 30;
+const double kCollapseInliers = 0.97;
+
+// The Kalman filter re-expands after kExpandSteps updates in a row where
+//   more than kExpandOutliers of the observations fail the 99% innovation
+//   gate, drawing the particles from its covariance widened by kExpandStd
+//   [x [m], y [m], yaw [rad]]
+const int kExpandSteps = 2;
+const double kExpandOutliers = 0.5;
+const double kExpandStd[3] = {2.0, 2.0, 0.1};
+
+// Augmented MCL keeps a slow and a fast running average of the
+//   likelihood per observation, with these smoothing factors per update,
+//   and injects particles with probability 1 - fast / (kInjectRatio slow).
+//   The margin keeps the ordinary swings of the likelihood with the
+//   landmarks in view from injecting while tracking
+const double kLikelihoodSlow = 0.01;
+const double kLikelihoodFast = 0.2;
+const double kInjectRatio = 0.2;
+
+// Headings tried when anchoring an injected particle on a landmark
+const int kInjectHeadings = 64;
+
+// Gauss-Newton iterations of refinePose, and the largest distance [m]
+//   between an observation and its landmark that still takes part
+const int kRefineIterations = 3;
+const double kRefineMaxResidual = 2.0;
 
 class ParticleFilter {  
  public:
+  // Loop order of updateWeights
+  enum UpdateOrder {
+    kUpdateOrderAuto,   // Pick from the particle and observation counts
+    kParticleMajor,     // All observations of one particle at a time
+    kObservationMajor   // One observation for a block of particles at a time
+  };
+
+  // Distribution the particles are moved with
+  enum Proposal {
+    kProposalMotion,   // Motion model alone
+    kProposalOptimal   // Motion model conditioned on the observations,
+                       //   linearized around each particle
+  };
+
+  // Selection scheme of resample
+  enum Resampler {
+    kResampleWheel,      // Resampling wheel, one random step per pick
+    kResampleSystematic  // Evenly spaced picks from one random offset
+  };
+
   // Constructor
   // @param num_particles Number of particles
-  ParticleFilter() : num_particles(0), is_initialized(false) {}
+  explicit ParticleFilter(int num_particles = 100)
+      : num_particles(num_particles), is_initialized(false), max_weight(0),
+        filter_stats(), filter_time(0), process_std(), max_replay_steps(0),
+        replaying(false), replay_back(0), smoothing_lag(-1), update_count(0),
+        spatial_sort(false), origin_x(0), origin_y(0),
+        update_order(kUpdateOrderAuto), chunk_size(0),
+        resampler(kResampleWheel), hybrid(false), is_collapsed(false),
+        ekf_x(0), ekf_y(0), ekf_theta(0), ekf_cov(), collapse_streak(0),
+        expand_streak(0), augmented(false), likelihood_slow(0),
+        likelihood_fast(0), proposal(kProposalMotion), noise_pending(false),
+        proposal_seed(0), regularized(false), weighted_mean(), weighted_cov(),
+        last_control() {}
 
   // Destructor
   ~ParticleFilter() {}
@@ -37,7 +143,7 @@ class ParticleFilter {
   /**
    * init Initializes particle filter by initializing particles to Gaussian
    *   distribution around first position and all the weights to 1.
-   * @param x Initial x position [m] (simulated estimate from GPS)
+   * @param x Initial global x position [m] (simulated estimate from GPS)
    * @param y Initial y position [m]
    * @param theta Initial orientation [rad]
    * @param std[] Array of dimension 3 [standard deviation of x [m], 
@@ -57,14 +163,52 @@ class ParticleFilter {
   void prediction(double delta_t, double std_pos[], double velocity, 
                   double yaw_rate);
   
+  /**
+   * predictionBatch Predicts the state through a sequence of controls
+   *   in a single pass over the particles. The process noise is drawn
+   *   once per particle, after the last control.
+   * @param controls Controls to apply, in time order
+   * @param std_pos[] Array of dimension 3 [standard deviation of x [m], 
+   *   standard deviation of y [m], standard deviation of yaw [rad]] of
+   *   the whole sequence, as for one prediction call over the same span
+   */
+  void predictionBatch(const std::vector<control_step_s> &controls,
+                       double std_pos[]);
+  
   /**
    * dataAssociation Finds which landmark observation corresponds to
-   *   (by using a nearest-neighbors data association).
-   * @param observation landmark observation
+   *   (by using a nearest-neighbors data association). Observations of a
+   *   known class are only matched to landmarks of that class once the
+   *   map index is built.
+   * @param observation landmark observation, relative to the local origin
    * @param map_landmarks contains vector of map landmarks
    */
   int dataAssociation(LandmarkObs observation, const Map &map_landmarks);
   
+  /**
+   * refinePose Aligns the observations to their landmarks around a pose
+   *   with Gauss-Newton iterations, associating again at every iteration
+   *   (ICP). Starting from the best particle or the weighted mean, this
+   *   gives a pose finer than the particle spacing.
+   * @param (x,y,theta) Pose in local coordinates to start from, refined
+   *   in place
+   * @param std_landmark[] Array of dimension 2
+   *   [Landmark measurement uncertainty [x [m], y [m]]]
+   * @param observations Vector of landmark observations
+   * @param map_landmarks Map class containing map landmarks
+   * @param prior_cov Row-major covariance of (x, y, theta) around the
+   *   starting pose, such as the covariance of the latest estimate; it
+   *   keeps the pose from following the noise of few observations. NULL
+   *   for a plain least-squares alignment
+   * @param iterations Number of Gauss-Newton iterations
+   * @output Number of observations in the last iteration; the pose is
+   *   left unchanged when fewer than two could be aligned without a prior
+   */
+  int refinePose(double &x, double &y, double &theta, const double std_landmark[],
+                 const std::vector<LandmarkObs> &observations,
+                 const Map &map_landmarks, const double *prior_cov = NULL,
+                 int iterations = kRefineIterations);
+  
   /**
    * updateWeights Updates the weights for each particle based on the likelihood
    *   of the observed measurements. 
@@ -83,6 +227,207 @@ class ParticleFilter {
    *   the new set of particles.
    */
   void resample();
+  
+  /**
+   * setSpatialSort Makes resample order the new particles by the Morton
+   *   code of their position, so that consecutive particles look up
+   *   nearby landmarks during updateWeights.
+   */
+  void setSpatialSort(bool enable) {
+    spatial_sort = enable;
+  }
+
+  /**
+   * setUpdateOrder Chooses the loop order of updateWeights. The
+   *   observation-major order computes the heading of every particle once,
+   *   and transforms and scores an observation for a block of particles
+   *   in vectorizable loops, summing log-weights per particle.
+   */
+  void setUpdateOrder(UpdateOrder order) {
+    update_order = order;
+  }
+
+  /**
+   * setThreads Spreads updateWeights over worker threads. Particles are
+   *   weighed in chunks handed out to the threads as they become free.
+   * @param threads Threads weighing particles, the caller included; 1 to
+   *   weigh on the calling thread only
+   * @param chunk_size Particles per chunk; 0 for a single chunk
+   */
+  void setThreads(int threads, size_t chunk_size);
+
+  /**
+   * setResampler Chooses the selection scheme of resample. Systematic
+   *   resampling draws one random number per resample instead of one per
+   *   particle, and picks each parent a number of times within one of its
+   *   expected count.
+   */
+  void setResampler(Resampler scheme) {
+    resampler = scheme;
+  }
+
+  /**
+   * setHybrid Lets the filter collapse to an extended Kalman filter while
+   *   the posterior is unimodal, and re-expand into particles when the
+   *   innovations no longer fit it (ambiguity, kidnapping). While
+   *   collapsed, particles holds a single particle at the Kalman mean and
+   *   resample does nothing. Not combined with enableHistory: a filter
+   *   keeping history never collapses.
+   */
+  void setHybrid(bool enable);
+
+  /**
+   * setProposal Chooses how particles are moved. With the optimal
+   *   proposal, prediction only applies the motion model, and
+   *   updateWeights draws the process noise of each particle from the
+   *   Gaussian the observations leave of it (one extended Kalman filter
+   *   step from the particle, with the process noise as prior). The
+   *   weights are the exact importance weights
+   *   p(z | x) p(x | x_prev) / q(x | x_prev, z), so fewer particles are
+   *   wasted where the observations rule them out, at the cost of an
+   *   association per observation and a 3x3 factorization per particle.
+   */
+  void setProposal(Proposal proposal);
+
+  /**
+   * setAugmented Enables augmented MCL. updateWeights tracks a slow and a
+   *   fast average of the likelihood of the observations; when the fast
+   *   one drops below the slow one, as after a kidnapping, resample
+   *   replaces a share of the particles with poses that put an
+   *   observation on a random landmark, at the heading that best fits a
+   *   second observation. A small particle set then suffices in normal
+   *   operation.
+   */
+  void setAugmented(bool enable) {
+    augmented = enable;
+    likelihood_slow = likelihood_fast = 0;
+    injections.clear();
+  }
+
+  /**
+   * setRegularized Enables the regularized particle filter. resample then
+   *   draws the particles from a Gaussian kernel density around the
+   *   picked parents instead of copying them, with the kernel shaped by
+   *   the weighted covariance of the particles and scaled by the optimal
+   *   bandwidth for N particles, h = (4 / (5 N))^(1/7). The parents are
+   *   first shrunk towards the weighted mean by sqrt(1 - h^2), so the
+   *   jitter leaves the covariance of the cloud unchanged. Duplicates of
+   *   a heavy parent spread out instead of collapsing onto one pose,
+   *   which keeps small particle sets diverse.
+   */
+  void setRegularized(bool enable) {
+    regularized = enable;
+  }
+
+  /**
+   * collapsed Returns whether the filter currently runs as a Kalman filter.
+   */
+  bool collapsed() const {
+    return is_collapsed;
+  }
+
+  /**
+   * latestEstimate Returns the estimate published by the last update.
+   *   Wait-free for the filter thread and safe to poll from any number
+   *   of other threads.
+   */
+  PoseEstimate latestEstimate() const {
+    return estimate_channel.read();
+  }
+
+  /**
+   * poseAt Returns the pose at a filter time (see time()), interpolated
+   *   between the recent estimates or extrapolated from the newest one
+   *   with the motion model, so that consumers get a pose for their own
+   *   timestamps without waiting for the next update. Lock-free and safe
+   *   from any number of threads.
+   * @output False if the time is not covered, see PoseHistory::query
+   */
+  bool poseAt(double stamp, PoseEstimate &pose) const {
+    return pose_history.query(stamp, pose);
+  }
+
+  /**
+   * enableHistory Starts keeping a ring of recent steps so that delayed
+   *   observations can be applied at the time they were taken.
+   * @param capacity Number of steps kept in the ring, raised to the
+   *   lag + 1 steps of enableSmoothing if smaller
+   * @param max_replay_steps Most steps a delayed frame may replay; older
+   *   frames are dropped to bound the cost of a single call
+   */
+  void enableHistory(int capacity, int max_replay_steps);
+  
+  /**
+   * updateDelayed Applies an observation frame taken before the current
+   *   step. The frame joins the observations of the newest recorded step
+   *   not later than it, moved to that step along the controls recorded
+   *   between the two stamps, and the filter replays the steps since then.
+   * @param stamp Filter time the observations were taken at [s]
+   * @param sensor_range Range [m] of sensor
+   * @param std_landmark[] Array of dimension 2
+   *   [Landmark measurement uncertainty [x [m], y [m]]]
+   * @param observations Vector of landmark observations
+   * @param map Map class containing map landmarks
+   * @output True if the frame was applied, false if it was dropped for
+   *   being older than the history or later than the last prediction
+   */
+  bool updateDelayed(double stamp, double sensor_range, double std_landmark[],
+                     const std::vector<LandmarkObs> &observations,
+                     const Map &map_landmarks);
+  
+  /**
+   * enableSmoothing Keeps at least the lag + 1 most recent steps in the
+   *   history ring, so that smoothedTrajectory can reach lag steps back.
+   *   Each step costs the compact state and the ancestor of every
+   *   particle, so the memory is bounded by (lag + 1) x N entries; a
+   *   larger ring from enableHistory is kept.
+   */
+  void enableSmoothing(int lag);
+  
+  /**
+   * smoothedTrajectory Fixed-lag smoothed poses of the last lag + 1 steps.
+   *   Each current particle is traced back through the ancestors recorded
+   *   by resample, and the state its ancestor had at a step takes the
+   *   particle's current weight, so the poses account for the
+   *   observations since that step. Lines started by injected particles
+   *   end at their injection and drop out of the older steps.
+   * @param lag Number of steps back, at most the number recorded - 1
+   * @param trajectory Receives the smoothed poses, oldest first; the
+   *   state of each step is the predicted one the update weighed
+   * @output False if the history does not reach lag steps back or no
+   *   line of descent does
+   */
+  bool smoothedTrajectory(int lag, std::vector<PoseEstimate> &trajectory) const;
+  
+  /**
+   * originX, originY Return the global position of the local origin that
+   *   particle coordinates are relative to. init sets it to the initial
+   *   position rounded to the kilometre and recenter moves it; maps keep
+   *   their own origin, and landmark positions are converted between the
+   *   two by a double offset.
+   */
+  double originX() const {
+    return origin_x;
+  }
+  double originY() const {
+    return origin_y;
+  }
+
+  /**
+   * recenter Moves the local origin, shifting the particles, the Kalman
+   *   state and nothing else: the map and the history entries keep their
+   *   own origin. O(particles), so it can run whenever the vehicle gets
+   *   far from the origin.
+   * @param (x,y) Global position of the new origin [m]
+   */
+  void recenter(double x, double y);
+
+  /**
+   * time Returns the filter time, the sum of the predicted intervals [s].
+   */
+  double time() const {
+    return filter_time;
+  }
 
   /**
    * Set a particles list of associations, along with the associations'
@@ -107,6 +452,14 @@ class ParticleFilter {
   std::string getAssociations(Particle best);
   std::string getSenseCoord(Particle best, std::string coord);
 
+  /**
+   * stats Returns the health metrics gathered during the last
+   *   updateWeights and resample calls.
+   */
+  const FilterStats &stats() const {
+    return filter_stats;
+  }
+
   // Set of current particles
   std::vector<Particle> particles;
 
@@ -122,6 +475,174 @@ class ParticleFilter {
   
   // Max particle weight
   double max_weight;
+
+  // Health metrics of the last update/resample
+  FilterStats filter_stats;
+  
+  // Sum of the predicted intervals [s]
+  double filter_time;
+  
+  // Process noise of the last prediction, reused when replaying
+  double process_std[3];
+  
+  // Parent of each particle picked by the last resample
+  std::vector<int> ancestors;
+  
+  // Ring of recent steps for delayed observations
+  StateHistory history;
+  int max_replay_steps;
+  
+  // Set while updateDelayed replays steps, with the replayed entry
+  bool replaying;
+  int replay_back;
+  
+  // Lag of enableSmoothing, -1 until enabled
+  int smoothing_lag;
+  
+  // Latest pose estimate, published after every update
+  SeqLock<PoseEstimate> estimate_channel;
+  uint64_t update_count;
+  
+  // Whether resample orders the particles along a Morton curve
+  bool spatial_sort;
+  
+  // Global position of the local origin of the particle coordinates [m]
+  double origin_x;
+  double origin_y;
+  
+  // Buffers of one thread weighing particles
+  struct WeighScratch {
+    // Queries and results of the blocked association scan
+    std::vector<double> query_x, query_y;
+    std::vector<int> query_landmark;
+    
+    // Per-lane buffers of the observation-major update
+    std::vector<double> lane_x, lane_y, lane_cos, lane_sin;
+    std::vector<double> lane_tx, lane_ty, lane_lx, lane_ly, lane_logw;
+    std::vector<int> lane_landmark;
+  };
+  
+  // Loop order of updateWeights
+  UpdateOrder update_order;
+  
+  // Threads weighing particles, none when weighing on the caller only
+  std::unique_ptr<WorkerPool> pool;
+  size_t chunk_size;
+  std::vector<WeighScratch> scratch;  // One per thread
+  
+  // Landmarks of the current updateWeights for the blocked scan, shared
+  //   by the threads
+  LandmarkColumns scan_landmarks;
+  
+  // Selection scheme of resample
+  Resampler resampler;
+  
+  // Hybrid mode, and the Kalman filter state while collapsed, in the
+  //   local frame: mean and row-major covariance of (x, y, theta)
+  bool hybrid;
+  bool is_collapsed;
+  double ekf_x, ekf_y, ekf_theta;
+  double ekf_cov[9];
+  
+  // Consecutive updates meeting the collapse and expansion conditions
+  int collapse_streak;
+  int expand_streak;
+  
+  // Augmented MCL, its likelihood averages, and the particles drawn by
+  //   the last update for the next resample to inject
+  bool augmented;
+  double likelihood_slow;
+  double likelihood_fast;
+  std::vector<Particle> injections;
+  
+  // Generator of the injected poses; unlike the per-call generators it
+  //   persists, so that each injection tries other landmarks
+  std::default_random_engine inject_gen;
+  
+  // Proposal of the particles; with the optimal one, whether the process
+  //   noise of the last prediction is still to be drawn, and the number
+  //   of proposals drawn so far, which seeds their generators
+  Proposal proposal;
+  bool noise_pending;
+  unsigned proposal_seed;
+  
+  // Whether resample jitters the particles, and the weighted mean and
+  //   covariance (row-major) of the particles over x, y, theta at the last
+  //   update, which shape the jitter
+  bool regularized;
+  double weighted_mean[3];
+  double weighted_cov[9];
+  
+  // Generator of the jitter and of the clouds drawn by expand, persistent
+  //   like inject_gen so that every resample and expansion draws afresh
+  std::default_random_engine jitter_gen;
+  
+  // Recent estimates for poseAt, and the control of the last prediction,
+  //   which they are moved with
+  PoseHistory pose_history;
+  control_step_s last_control;
+  
+  // Sets the weights of particles [begin, end)
+  void weighParticles(size_t begin, size_t end, const double std_landmark[],
+                      const std::vector<LandmarkObs> &observations,
+                      const Map &map_landmarks, bool blocked_scan,
+                      bool observation_major, bool propose,
+                      WeighScratch &scratch);
+  
+  // Draws the pending process noise of particles [begin, end) from the
+  //   optimal proposal and sets their importance weights
+  void proposeParticles(size_t begin, size_t end, const double std_landmark[],
+                        const std::vector<LandmarkObs> &observations,
+                        const Map &map_landmarks, WeighScratch &scratch);
+  
+  // Draws the pending process noise from the motion model
+  void drawProcessNoise();
+  
+  // Sets the weights of particles [begin, end) with the observation-major
+  //   loop order
+  void weighObservationMajor(size_t begin, size_t end,
+                             const double std_landmark[],
+                             const std::vector<LandmarkObs> &observations,
+                             const Map &map_landmarks, bool blocked_scan,
+                             WeighScratch &scratch);
+  
+  // Kalman filter counterparts of prediction and updateWeights
+  void predictKalman(const control_step_s &control, const double std_pos[],
+                     bool add_noise);
+  void updateKalman(const double std_landmark[],
+                    const std::vector<LandmarkObs> &observations,
+                    const Map &map_landmarks);
+  
+  // Returns whether the weighted particles fit a Gaussian of the given
+  //   local mean and covariance
+  bool posteriorIsGaussian(double mean_x, double mean_y, double mean_theta,
+                           const double cov[9]) const;
+  
+  // Draws the particles to inject, each of them with probability rate
+  void drawInjections(double rate, const std::vector<LandmarkObs> &observations,
+                      const Map &map_landmarks);
+  
+  // Switches between the particles and the Kalman filter
+  void collapse(double mean_x, double mean_y, double mean_theta,
+                const double cov[9]);
+  void expand();
+  
+  // Publishes the Kalman filter state as the estimate
+  void publishKalman();
+  
+  // Publishes an estimate to latestEstimate and poseAt, replacing the
+  //   newest one if amend is set
+  void publishEstimate(const PoseEstimate &estimate, bool amend = false);
+  
+  // Returns the position of a landmark relative to the local origin
+  void landmarkLocal(const Map &map, int i, double &x, double &y) const {
+    map.landmarkPosition(i, x, y);
+    x += map.origin_x - origin_x;
+    y += map.origin_y - origin_y;
+  }
+  
+  // Advances the filter time and records a control in the history
+  void advance(const control_step_s &control, bool noise_drawn);
 };
 
 #endif  // PARTICLE_FILTER_H_
@@ -0,0 +1,383 @@
+/**
+ * particle_recorder.cpp
+ *
+ * Frame layout (little endian):
+ *   uint32 magic, uint32 step, uint32 num_particles,
+ *   double est_x, double est_y, double est_theta,
+ *   uint32 raw_size, uint32 compressed_size, payload[compressed_size]
+ * The inflated payload holds the x, y and theta columns as zigzag varints
+ *   of the deltas between consecutive quantized values, followed by the
+ *   normalized weights as raw floats.
+ *
+ * After the last frame, a closed recording holds the frame index:
+ *   uint32 index magic, uint32 count, count x (uint32 step, uint64 offset),
+ *   and ends with uint64 offset of the index, uint32 index magic. Version
+ *   1 recordings have raw weights and no index.
+ */
+
+#include "particle_recorder.h"
+
+#include <math.h>
+#include <string.h>
+#include <zlib.h>
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+namespace {
+
+const uint32_t kFileMagic = 0x43524650;   // "PFRC"
+const uint32_t kFrameMagic = 0x54534650;  // "PFST"
+const uint32_t kIndexMagic = 0x58494650;  // "PFIX"
+const uint32_t kVersion = 2;
+const size_t kIndexTrailerSize = 8 + 4;
+const size_t kFrameHeaderSize = 3 * 4 + 3 * 8 + 2 * 4;
+
+void putVarint(vector<unsigned char> &buf, int64_t value) {
+  // zigzag so that small negative deltas stay small
+  uint64_t v = (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+  while (v >= 0x80) {
+    buf.push_back(static_cast<unsigned char>(v | 0x80));
+    v >>= 7;
+  }
+  buf.push_back(static_cast<unsigned char>(v));
+}
+
+bool getVarint(const unsigned char *&p, const unsigned char *end, int64_t &value) {
+  uint64_t v = 0;
+  for (int shift = 0; p < end && shift < 64; shift += 7) {
+    unsigned char b = *p++;
+    v |= static_cast<uint64_t>(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      value = static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+void putColumn(vector<unsigned char> &buf, const vector<double> &col, double step) {
+  int64_t prev = 0;
+  for (size_t i = 0; i < col.size(); ++i) {
+    int64_t q = llround(col[i] / step);
+    putVarint(buf, q - prev);
+    prev = q;
+  }
+}
+
+bool getColumn(const unsigned char *&p, const unsigned char *end,
+               vector<double> &col, size_t n, double step) {
+  col.resize(n);
+  int64_t q = 0;
+  for (size_t i = 0; i < n; ++i) {
+    int64_t delta;
+    if (!getVarint(p, end, delta)) {
+      return false;
+    }
+    q += delta;
+    col[i] = q * step;
+  }
+  return true;
+}
+
+template <typename T>
+void putRaw(unsigned char *&p, T value) {
+  memcpy(p, &value, sizeof(T));
+  p += sizeof(T);
+}
+
+template <typename T>
+T getRaw(const unsigned char *&p) {
+  T value;
+  memcpy(&value, p, sizeof(T));
+  p += sizeof(T);
+  return value;
+}
+
+}  // namespace
+
+bool ParticleRecorder::open(const string &filename, int max_queued) {
+  close();
+  out.open(filename.c_str(), std::ofstream::binary | std::ofstream::trunc);
+  if (!out) {
+    return false;
+  }
+  out.write(reinterpret_cast<const char *>(&kFileMagic), sizeof(kFileMagic));
+  out.write(reinterpret_cast<const char *>(&kVersion), sizeof(kVersion));
+
+  this->max_queued = max_queued;
+  dropped_frames = 0;
+  stopping = false;
+  frame_offsets.clear();
+  writer = std::thread(&ParticleRecorder::run, this);
+  return true;
+}
+
+void ParticleRecorder::record(uint32_t step, const vector<Particle> &particles,
+                              double origin_x, double origin_y,
+                              double est_x, double est_y, double est_theta) {
+  if (!isOpen()) {
+    return;
+  }
+
+  RecordedStep frame;
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    if (static_cast<int>(queue.size()) >= max_queued) {
+      ++dropped_frames;
+      return;
+    }
+    // Reuse a buffer the writer is done with to avoid reallocations
+    if (!free_frames.empty()) {
+      frame.x.swap(free_frames.back().x);
+      frame.y.swap(free_frames.back().y);
+      frame.theta.swap(free_frames.back().theta);
+      frame.weight.swap(free_frames.back().weight);
+      free_frames.pop_back();
+    }
+  }
+
+  size_t n = particles.size();
+  frame.step = step;
+  frame.est_x = est_x;
+  frame.est_y = est_y;
+  frame.est_theta = est_theta;
+  frame.x.resize(n);
+  frame.y.resize(n);
+  frame.theta.resize(n);
+  frame.weight.resize(n);
+  // Normalize the weights before narrowing them, as raw likelihood
+  //   products are often below the float range
+  double total = 0;
+  for (size_t i = 0; i < n; ++i) {
+    total += particles[i].weight;
+  }
+  double scale = total > 0 && std::isfinite(total) ? 1 / total : 0;
+  for (size_t i = 0; i < n; ++i) {
+    frame.x[i] = origin_x + particles[i].x;
+    frame.y[i] = origin_y + particles[i].y;
+    frame.theta[i] = particles[i].theta;
+    frame.weight[i] = static_cast<float>(particles[i].weight * scale);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    queue.push_back(RecordedStep());
+    queue.back().step = frame.step;
+    queue.back().est_x = frame.est_x;
+    queue.back().est_y = frame.est_y;
+    queue.back().est_theta = frame.est_theta;
+    queue.back().x.swap(frame.x);
+    queue.back().y.swap(frame.y);
+    queue.back().theta.swap(frame.theta);
+    queue.back().weight.swap(frame.weight);
+  }
+  queue_cv.notify_one();
+}
+
+void ParticleRecorder::close() {
+  if (!isOpen()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    stopping = true;
+  }
+  queue_cv.notify_one();
+  writer.join();
+  out.close();
+}
+
+void ParticleRecorder::run() {
+  vector<unsigned char> raw;
+  vector<unsigned char> compressed;
+  unsigned char header[kFrameHeaderSize];
+
+  while (true) {
+    RecordedStep frame;
+    {
+      std::unique_lock<std::mutex> lock(queue_mutex);
+      queue_cv.wait(lock, [this] { return stopping || !queue.empty(); });
+      if (queue.empty()) {
+        break;
+      }
+      std::swap(frame, queue.front());
+      queue.pop_front();
+    }
+
+    // Encode the columns
+    size_t n = frame.x.size();
+    raw.clear();
+    putColumn(raw, frame.x, kRecordPosStep);
+    putColumn(raw, frame.y, kRecordPosStep);
+    putColumn(raw, frame.theta, kRecordThetaStep);
+    size_t weights_at = raw.size();
+    raw.resize(weights_at + n * sizeof(float));
+    if (n) {
+      memcpy(&raw[weights_at], &frame.weight[0], n * sizeof(float));
+    }
+
+    // Compress them
+    uLongf compressed_size = compressBound(raw.size());
+    compressed.resize(compressed_size);
+    if (compress2(&compressed[0], &compressed_size, raw.data(), raw.size(),
+                  Z_BEST_SPEED) != Z_OK) {
+      continue;
+    }
+
+    unsigned char *p = header;
+    putRaw<uint32_t>(p, kFrameMagic);
+    putRaw<uint32_t>(p, frame.step);
+    putRaw<uint32_t>(p, static_cast<uint32_t>(n));
+    putRaw<double>(p, frame.est_x);
+    putRaw<double>(p, frame.est_y);
+    putRaw<double>(p, frame.est_theta);
+    putRaw<uint32_t>(p, static_cast<uint32_t>(raw.size()));
+    putRaw<uint32_t>(p, static_cast<uint32_t>(compressed_size));
+    frame_offsets.push_back(std::make_pair(frame.step, static_cast<uint64_t>(out.tellp())));
+    out.write(reinterpret_cast<const char *>(header), kFrameHeaderSize);
+    out.write(reinterpret_cast<const char *>(compressed.data()), compressed_size);
+
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    free_frames.push_back(RecordedStep());
+    free_frames.back().x.swap(frame.x);
+    free_frames.back().y.swap(frame.y);
+    free_frames.back().theta.swap(frame.theta);
+    free_frames.back().weight.swap(frame.weight);
+  }
+
+  // Append the frame index
+  uint64_t index_at = static_cast<uint64_t>(out.tellp());
+  uint32_t count = static_cast<uint32_t>(frame_offsets.size());
+  out.write(reinterpret_cast<const char *>(&kIndexMagic), sizeof(kIndexMagic));
+  out.write(reinterpret_cast<const char *>(&count), sizeof(count));
+  for (size_t i = 0; i < frame_offsets.size(); ++i) {
+    out.write(reinterpret_cast<const char *>(&frame_offsets[i].first), sizeof(uint32_t));
+    out.write(reinterpret_cast<const char *>(&frame_offsets[i].second), sizeof(uint64_t));
+  }
+  out.write(reinterpret_cast<const char *>(&index_at), sizeof(index_at));
+  out.write(reinterpret_cast<const char *>(&kIndexMagic), sizeof(kIndexMagic));
+  out.flush();
+}
+
+bool RecordReader::open(const string &filename) {
+  in.open(filename.c_str(), std::ifstream::binary);
+  if (!in) {
+    return false;
+  }
+  uint32_t magic = 0, version = 0;
+  in.read(reinterpret_cast<char *>(&magic), sizeof(magic));
+  in.read(reinterpret_cast<char *>(&version), sizeof(version));
+  if (!in || magic != kFileMagic || (version != 1 && version != kVersion)) {
+    return false;
+  }
+
+  // Load the frame index if the recording was closed properly
+  frame_offsets.clear();
+  std::streampos first_frame = in.tellg();
+  uint64_t index_at = 0;
+  uint32_t trailer_magic = 0, index_magic = 0, count = 0;
+  if (version == kVersion
+      && in.seekg(-static_cast<std::streamoff>(kIndexTrailerSize), std::ifstream::end)
+      && in.read(reinterpret_cast<char *>(&index_at), sizeof(index_at))
+      && in.read(reinterpret_cast<char *>(&trailer_magic), sizeof(trailer_magic))
+      && trailer_magic == kIndexMagic
+      && in.seekg(static_cast<std::streamoff>(index_at))
+      && in.read(reinterpret_cast<char *>(&index_magic), sizeof(index_magic))
+      && in.read(reinterpret_cast<char *>(&count), sizeof(count))
+      && index_magic == kIndexMagic) {
+    frame_offsets.resize(count);
+    for (uint32_t i = 0; i < count && in; ++i) {
+      in.read(reinterpret_cast<char *>(&frame_offsets[i].first), sizeof(uint32_t));
+      in.read(reinterpret_cast<char *>(&frame_offsets[i].second), sizeof(uint64_t));
+    }
+    if (!in) {
+      frame_offsets.clear();
+    }
+  }
+  in.clear();
+  in.seekg(first_frame);
+  return true;
+}
+
+bool RecordReader::next(RecordedStep &frame, bool decode) {
+  unsigned char header[kFrameHeaderSize];
+  if (!in.read(reinterpret_cast<char *>(header), kFrameHeaderSize)) {
+    return false;
+  }
+
+  const unsigned char *p = header;
+  if (getRaw<uint32_t>(p) != kFrameMagic) {
+    return false;
+  }
+  frame.step = getRaw<uint32_t>(p);
+  uint32_t n = getRaw<uint32_t>(p);
+  frame.est_x = getRaw<double>(p);
+  frame.est_y = getRaw<double>(p);
+  frame.est_theta = getRaw<double>(p);
+  uint32_t raw_size = getRaw<uint32_t>(p);
+  uint32_t compressed_size = getRaw<uint32_t>(p);
+
+  if (!decode) {
+    frame.x.clear();
+    frame.y.clear();
+    frame.theta.clear();
+    frame.weight.clear();
+    return static_cast<bool>(in.seekg(compressed_size, std::ifstream::cur));
+  }
+
+  compressed.resize(compressed_size);
+  raw.resize(raw_size);
+  if (!in.read(reinterpret_cast<char *>(compressed.data()), compressed_size)) {
+    return false;
+  }
+  uLongf inflated = raw_size;
+  if (uncompress(raw.data(), &inflated, compressed.data(), compressed_size) != Z_OK
+      || inflated != raw_size) {
+    return false;
+  }
+
+  const unsigned char *q = raw.data();
+  const unsigned char *end = q + raw_size;
+  if (!getColumn(q, end, frame.x, n, kRecordPosStep)
+      || !getColumn(q, end, frame.y, n, kRecordPosStep)
+      || !getColumn(q, end, frame.theta, n, kRecordThetaStep)
+      || static_cast<size_t>(end - q) != n * sizeof(float)) {
+    return false;
+  }
+  frame.weight.resize(n);
+  if (n) {
+    memcpy(&frame.weight[0], q, n * sizeof(float));
+  }
+  return true;
+}
+
+bool RecordReader::seekStep(uint32_t step) {
+  // Binary search of the index; steps are recorded in increasing order
+  if (!frame_offsets.empty()) {
+    std::vector<std::pair<uint32_t, uint64_t> >::const_iterator it =
+        std::lower_bound(frame_offsets.begin(), frame_offsets.end(),
+                         std::make_pair(step, static_cast<uint64_t>(0)));
+    if (it == frame_offsets.end()) {
+      return false;
+    }
+    in.clear();
+    return static_cast<bool>(in.seekg(static_cast<std::streamoff>(it->second)));
+  }
+
+  RecordedStep frame;
+  while (true) {
+    std::streampos at = in.tellg();
+    if (!next(frame, false)) {
+      return false;
+    }
+    if (frame.step >= step) {
+      in.seekg(at);
+      return true;
+    }
+  }
+}
@@ -0,0 +1,150 @@
+/**
+ * particle_recorder.h
+ * Streaming recorder of per-step particle clouds.
+ *
+ * Every recorded step becomes one frame: a small fixed-size header
+ *   followed by a zlib-compressed payload with the particle columns
+ *   (x, y, theta quantized and delta-encoded, weights normalized to sum
+ *   to 1 as floats). Encoding and writing happen on a background thread
+ *   so that the filter only pays for copying the particle state. Closing
+ *   the recording appends an index of the frame offsets, which lets the
+ *   reader seek to a step without scanning the file.
+ */
+
+#ifndef PARTICLE_RECORDER_H_
+#define PARTICLE_RECORDER_H_
+
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "particle_filter.h"
+
+// Quantization steps of the recorded columns
+const double kRecordPosStep = 1e-3;    // [m]
+const double kRecordThetaStep = 1e-5;  // [rad]
+
+/**
+ * Struct holding one decoded (or to be encoded) step of the recording.
+ */
+struct RecordedStep {
+  uint32_t step;       // Filter step number
+  double est_x;        // Estimated x position [m]
+  double est_y;        // Estimated y position [m]
+  double est_theta;    // Estimated yaw [rad]
+  std::vector<double> x;
+  std::vector<double> y;
+  std::vector<double> theta;
+  std::vector<float> weight;  // Normalized weights
+};
+
+class ParticleRecorder {
+ public:
+  ParticleRecorder() : max_queued(0), dropped_frames(0), stopping(false) {}
+
+  // Flushes the queued frames and closes the file
+  ~ParticleRecorder() {
+    close();
+  }
+
+  /**
+   * open Creates the recording file and starts the writer thread.
+   * @param filename Path of the recording
+   * @param max_queued Frames allowed to wait for the writer; further
+   *   frames are dropped rather than stalling the filter
+   * @output True if the file could be created
+   */
+  bool open(const std::string &filename, int max_queued = 64);
+
+  /**
+   * record Queues a copy of the particle cloud and the estimate.
+   * @param step Filter step number
+   * @param particles Current particle set
+   * @param (origin_x, origin_y) Global position of the local origin of
+   *   the particles, added back so the recording is in global coordinates
+   * @param (est_x, est_y, est_theta) Reported global pose estimate
+   */
+  void record(uint32_t step, const std::vector<Particle> &particles,
+              double origin_x, double origin_y,
+              double est_x, double est_y, double est_theta);
+
+  /**
+   * close Waits for the writer to drain the queue and closes the file.
+   */
+  void close();
+
+  /**
+   * isOpen Returns whether frames are being recorded.
+   */
+  bool isOpen() const {
+    return writer.joinable();
+  }
+
+  /**
+   * dropped Returns the number of frames dropped because the writer
+   *   was too far behind.
+   */
+  int dropped() const {
+    return dropped_frames;
+  }
+
+ private:
+  // Writer thread loop, encodes and writes queued frames
+  void run();
+
+  std::ofstream out;
+  std::thread writer;
+  std::mutex queue_mutex;
+  std::condition_variable queue_cv;
+
+  // Frames waiting for the writer, and recycled frame buffers
+  std::deque<RecordedStep> queue;
+  std::vector<RecordedStep> free_frames;
+
+  // Step and file offset of every written frame, for the index
+  std::vector<std::pair<uint32_t, uint64_t> > frame_offsets;
+
+  int max_queued;
+  int dropped_frames;
+  bool stopping;
+};
+
+class RecordReader {
+ public:
+  /**
+   * open Opens a recording and checks its file header.
+   * @output True if the file is a particle recording
+   */
+  bool open(const std::string &filename);
+
+  /**
+   * next Reads the next frame of the recording.
+   * @param frame Receives the frame; particle columns are only filled
+   *   when decode is true
+   * @param decode Whether to inflate and decode the payload; when false
+   *   the payload is skipped with a seek
+   * @output False at the end of the file or on a corrupt frame
+   */
+  bool next(RecordedStep &frame, bool decode = true);
+
+  /**
+   * seekStep Positions the reader on the first frame whose step is not
+   *   lower than the given one, through the frame index when the
+   *   recording was closed properly, otherwise by skipping payloads from
+   *   the current frame on.
+   * @output False if no such frame exists
+   */
+  bool seekStep(uint32_t step);
+
+ private:
+  std::ifstream in;
+  std::vector<std::pair<uint32_t, uint64_t> > frame_offsets;  // From the index
+  std::vector<unsigned char> compressed;
+  std::vector<unsigned char> raw;
+};
+
+#endif  // PARTICLE_RECORDER_H_
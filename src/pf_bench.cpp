@@ -0,0 +1,1337 @@
+/**
+ * pf_bench.cpp
+ * Micro-benchmarks of the particle filter building blocks.
+ *
+ * Usage: pf_bench <benchmark> [arguments]
+ *   Run without arguments to list the benchmarks.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "blocked_scan.h"
+#include "filter_config.h"
+#include "map_store.h"
+#include "particle_filter.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double secondsSince(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Hardware cache-miss counter of the calling thread, where perf events
+//   are available; reports -1 otherwise
+class CacheMissCounter {
+ public:
+  CacheMissCounter() : fd(-1) {
+#ifdef __linux__
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+  }
+
+  ~CacheMissCounter() {
+#ifdef __linux__
+    if (fd >= 0) {
+      close(fd);
+    }
+#endif
+  }
+
+  void start() {
+#ifdef __linux__
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+  }
+
+  long long stop() {
+    long long count = -1;
+#ifdef __linux__
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+      if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+        count = -1;
+      }
+    }
+#endif
+    return count;
+  }
+
+ private:
+  int fd;
+};
+
+int intArg(int argc, char *argv[], int i, int fallback) {
+  return i < argc ? atoi(argv[i]) : fallback;
+}
+
+// Map of uniformly scattered landmarks, with a density like map_data.txt
+void makeRandomMap(int num_landmarks, unsigned seed, Map &map) {
+  double extent = 50.0 * sqrt(static_cast<double>(num_landmarks));
+  std::mt19937 gen(seed);
+  std::uniform_real_distribution<float> coord(0, extent);
+  map.landmark_list.resize(num_landmarks);
+  for (int i = 0; i < num_landmarks; ++i) {
+    map.landmark_list[i].id_i = i + 1;
+    map.landmark_list[i].x_f = coord(gen);
+    map.landmark_list[i].y_f = coord(gen);
+  }
+}
+
+/**
+ * Cost of incremental landmark edits against rebuilding the index.
+ *   Arguments: [landmarks=1000000] [edits=10000]
+ */
+int benchIndexUpdate(int argc, char *argv[]) {
+  int num_landmarks = intArg(argc, argv, 2, 1000000);
+  int num_edits = intArg(argc, argv, 3, 10000);
+
+  Map map;
+  makeRandomMap(num_landmarks, 1, map);
+  double extent = 50.0 * sqrt(static_cast<double>(num_landmarks));
+
+  Clock::time_point start = Clock::now();
+  map.buildIndex();
+  double rebuild = secondsSince(start);
+
+  // Mix of adds, moves and removals on the indexed map
+  std::mt19937 gen(2);
+  std::uniform_real_distribution<float> coord(0, extent);
+  int next_id = num_landmarks + 1;
+  start = Clock::now();
+  for (int i = 0; i < num_edits; ++i) {
+    int id = 1 + gen() % num_landmarks;
+    switch (i % 3) {
+      case 0:
+        map.addLandmark(next_id++, coord(gen), coord(gen));
+        break;
+      case 1:
+        map.moveLandmark(id, coord(gen), coord(gen));
+        break;
+      case 2:
+        map.removeLandmark(id);
+        break;
+    }
+  }
+  double edits = secondsSince(start);
+
+  // The copy every published batch makes, against rebuilding the index
+  //   of that copy from scratch
+  start = Clock::now();
+  Map copy = map;
+  double copied = secondsSince(start);
+  start = Clock::now();
+  copy.buildIndex();
+  double rebuilt = secondsSince(start);
+
+  // Same kind of edits through the store, one published copy per batch
+  MapStore store;
+  store.publish(std::make_shared<Map>(map));
+  vector<LandmarkEdit> batch(100);
+  for (size_t i = 0; i < batch.size(); ++i) {
+    LandmarkEdit edit = {LandmarkEdit::kMove, 1 + static_cast<int>(gen() % num_landmarks),
+                         coord(gen), coord(gen), -1};
+    batch[i] = edit;
+  }
+  start = Clock::now();
+  store.applyEdits(batch);
+  double published = secondsSince(start);
+
+  std::cout << "landmarks " << num_landmarks << "\n"
+            << "full rebuild " << rebuild * 1e3 << " ms\n"
+            << "incremental edit " << edits / num_edits * 1e6 << " us/edit ("
+            << map.index.rebuildCount() << " lazy rebuilds over " << num_edits
+            << " edits)\n"
+            << "published batch of " << batch.size() << " edits "
+            << published * 1e3 << " ms, of which copying the map "
+            << copied * 1e3 << " ms (rebuilding the copied index "
+            << rebuilt * 1e3 << " ms)" << std::endl;
+  return 0;
+}
+
+// Query points spread uniformly over the map
+void uniformQueries(int num_queries, double extent, vector<double> &qx,
+                    vector<double> &qy) {
+  std::mt19937 gen(7);
+  std::uniform_real_distribution<double> coord(0, extent);
+  qx.resize(num_queries);
+  qy.resize(num_queries);
+  for (int i = 0; i < num_queries; ++i) {
+    qx[i] = coord(gen);
+    qy[i] = coord(gen);
+  }
+}
+
+// Query points as updateWeights produces them: per step, a cloud of
+//   particles around a vehicle driving across the map, each with the
+//   observations of the landmarks around it
+void trackQueries(int num_queries, double extent, vector<double> &qx,
+                  vector<double> &qy) {
+  std::mt19937 gen(7);
+  std::normal_distribution<double> particle(0, 1.0);
+  std::uniform_real_distribution<double> observation(-50, 50);
+  qx.clear();
+  qy.clear();
+  double x = 0, y = extent / 2;
+  while (static_cast<int>(qx.size()) < num_queries) {
+    x = fmod(x + 1.0, extent);
+    y = extent / 2 + extent / 3 * sin(x / extent * 2 * M_PI);
+    for (int p = 0; p < 100; ++p) {
+      double px = x + particle(gen), py = y + particle(gen);
+      for (int o = 0; o < 10; ++o) {
+        qx.push_back(px + observation(gen));
+        qy.push_back(py + observation(gen));
+      }
+    }
+  }
+  qx.resize(num_queries);
+  qy.resize(num_queries);
+}
+
+// Runs the association and landmark lookup of updateWeights for each
+//   query, returning the time per query [s] and the cache misses
+double timeQueries(const Map &map, const vector<double> &qx,
+                   const vector<double> &qy, long long &misses) {
+  ParticleFilter pf;
+  LandmarkObs obs;
+  obs.class_i = 0;
+  double checksum = 0;
+  CacheMissCounter counter;
+  Clock::time_point start = Clock::now();
+  counter.start();
+  for (size_t i = 0; i < qx.size(); ++i) {
+    obs.x = qx[i];
+    obs.y = qy[i];
+    double x, y;
+    map.landmarkPosition(pf.dataAssociation(obs, map), x, y);
+    checksum += x + y;
+  }
+  misses = counter.stop();
+  double seconds = secondsSince(start);
+  if (checksum == -1) {
+    std::cout << checksum;
+  }
+  return seconds / qx.size();
+}
+
+/**
+ * Footprint, association speed and precision of the compact map against
+ *   landmark_list plus its index.
+ *   Arguments: [landmarks=10000000] [queries=1000000]
+ */
+int benchCompactMap(int argc, char *argv[]) {
+  int num_landmarks = intArg(argc, argv, 2, 10000000);
+  int num_queries = intArg(argc, argv, 3, 1000000);
+  double extent = 50.0 * sqrt(static_cast<double>(num_landmarks));
+
+  Map map;
+  makeRandomMap(num_landmarks, 1, map);
+  map.buildIndex();
+  size_t full_bytes = map.landmark_list.capacity() * sizeof(Map::single_landmark_s)
+                      + map.index.size() * (sizeof(IndexPoint) + sizeof(int));
+  vector<double> qx, qy;
+  uniformQueries(num_queries, extent, qx, qy);
+  long long full_misses;
+  double full_query = timeQueries(map, qx, qy, full_misses);
+
+  Map compact_map;
+  makeRandomMap(num_landmarks, 1, compact_map);
+  vector<Map::single_landmark_s> original = compact_map.landmark_list;
+  Clock::time_point start = Clock::now();
+  compact_map.compactify();
+  double build = secondsSince(start);
+  long long compact_misses;
+  double compact_query = timeQueries(compact_map, qx, qy, compact_misses);
+
+  // Measured decoding error, matching landmarks by ID
+  vector<int> by_id(num_landmarks + 1);
+  for (int i = 0; i < num_landmarks; ++i) {
+    by_id[compact_map.compact.id(i)] = i;
+  }
+  double max_error = 0;
+  for (int i = 0; i < num_landmarks; ++i) {
+    double x, y;
+    compact_map.landmarkPosition(by_id[original[i].id_i], x, y);
+    max_error = std::max(max_error, std::max(fabs(x - original[i].x_f),
+                                             fabs(y - original[i].y_f)));
+  }
+
+  std::cout << "landmarks " << num_landmarks << "\n"
+            << "list + 2d-tree " << full_bytes / 1048576.0 << " MiB, "
+            << full_query * 1e9 << " ns/query, " << full_misses << " cache misses\n"
+            << "compact " << compact_map.compact.memoryBytes() / 1048576.0 << " MiB, "
+            << compact_query * 1e9 << " ns/query, " << compact_misses
+            << " cache misses (build " << build * 1e3 << " ms)\n"
+            << "max error " << max_error * 1e3 << " mm (bound "
+            << compact_map.compact.maxError() * 1e3 << " mm)" << std::endl;
+  return 0;
+}
+
+/**
+ * Association speed over a map in file (random) order against the same
+ *   map sorted along a Morton curve, with queries following a vehicle.
+ *   Arguments: [landmarks=10000000] [queries=2000000]
+ */
+int benchLandmarkOrder(int argc, char *argv[]) {
+  int num_landmarks = intArg(argc, argv, 2, 10000000);
+  int num_queries = intArg(argc, argv, 3, 2000000);
+  double extent = 50.0 * sqrt(static_cast<double>(num_landmarks));
+  vector<double> qx, qy;
+  trackQueries(num_queries, extent, qx, qy);
+
+  const char *names[] = {"file order", "morton order"};
+  for (int sorted = 0; sorted < 2; ++sorted) {
+    Map map;
+    makeRandomMap(num_landmarks, 1, map);
+    Clock::time_point start = Clock::now();
+    if (sorted) {
+      map.reorderLandmarks();
+    }
+    double reorder = secondsSince(start);
+    map.buildIndex();
+
+    long long misses;
+    double query = timeQueries(map, qx, qy, misses);
+    std::cout << names[sorted] << ": " << query * 1e9 << " ns/query, "
+              << misses << " cache misses";
+    if (sorted) {
+      std::cout << " (reorder " << reorder * 1e3 << " ms)";
+    }
+    std::cout << std::endl;
+  }
+  return 0;
+}
+
+/**
+ * Cost of the Morton-sorted resample gather, and its effect on the
+ *   following update, for a large particle cloud on a large map.
+ *   Arguments: [particles=100000] [landmarks=1000000] [steps=5]
+ */
+int benchResampleSort(int argc, char *argv[]) {
+  int num_particles = intArg(argc, argv, 2, 100000);
+  int num_landmarks = intArg(argc, argv, 3, 1000000);
+  int steps = intArg(argc, argv, 4, 5);
+  double extent = 50.0 * sqrt(static_cast<double>(num_landmarks));
+
+  Map map;
+  makeRandomMap(num_landmarks, 1, map);
+  map.reorderLandmarks();
+  map.buildIndex();
+
+  // Observations of the landmarks around the middle of the map
+  vector<LandmarkObs> observations;
+  for (size_t i = 0; i < map.landmark_list.size() && observations.size() < 10; ++i) {
+    double dx = map.landmark_list[i].x_f - extent / 2;
+    double dy = map.landmark_list[i].y_f - extent / 2;
+    if (dx * dx + dy * dy < 50 * 50) {
+      LandmarkObs obs = {0, dx, dy};
+      observations.push_back(obs);
+    }
+  }
+
+  double sigma_pos[3] = {2.0, 2.0, 0.05};
+  double sigma_landmark[2] = {0.3, 0.3};
+  const char *names[] = {"wheel order", "morton order"};
+  for (int sorted = 0; sorted < 2; ++sorted) {
+    ParticleFilter pf(num_particles);
+    pf.setSpatialSort(sorted);
+    pf.init(extent / 2, extent / 2, 0, sigma_pos);
+    double update = 0, resample = 0;
+    for (int step = 0; step < steps; ++step) {
+      pf.predictionBatch(vector<control_step_s>(1, control_step_s{0, 0, 0.1}), sigma_pos);
+      Clock::time_point start = Clock::now();
+      pf.updateWeights(50, sigma_landmark, observations, map);
+      update += secondsSince(start);
+      start = Clock::now();
+      pf.resample();
+      resample += secondsSince(start);
+    }
+    std::cout << names[sorted] << ": update " << update / steps * 1e3
+              << " ms, resample " << resample / steps * 1e3 << " ms" << std::endl;
+  }
+  return 0;
+}
+
+/**
+ * Association speed with an index per landmark class against the index
+ *   over all landmarks, for observations of a known class. Also reports
+ *   how often the class-blind association picks a landmark of another
+ *   class.
+ *   Arguments: [landmarks=1000000] [classes=8] [queries=1000000]
+ */
+int benchClassIndex(int argc, char *argv[]) {
+  int num_landmarks = intArg(argc, argv, 2, 1000000);
+  int num_classes = intArg(argc, argv, 3, 8);
+  int num_queries = intArg(argc, argv, 4, 1000000);
+  double extent = 50.0 * sqrt(static_cast<double>(num_landmarks));
+
+  Map map;
+  makeRandomMap(num_landmarks, 1, map);
+  std::mt19937 gen(2);
+  std::uniform_int_distribution<int> landmark_class(1, num_classes);
+  for (size_t i = 0; i < map.landmark_list.size(); ++i) {
+    map.landmark_list[i].class_i = landmark_class(gen);
+  }
+  map.reorderLandmarks();
+  map.buildIndex();
+
+  // Observations near a random landmark, of the class of that landmark
+  std::uniform_int_distribution<int> pick(0, num_landmarks - 1);
+  std::normal_distribution<double> noise(0, 0.3);
+  vector<LandmarkObs> queries(num_queries);
+  for (int i = 0; i < num_queries; ++i) {
+    const Map::single_landmark_s &landmark = map.landmark_list[pick(gen)];
+    queries[i].id = 0;
+    queries[i].x = landmark.x_f + noise(gen);
+    queries[i].y = landmark.y_f + noise(gen);
+    queries[i].class_i = landmark.class_i;
+  }
+
+  ParticleFilter pf;
+  const char *names[] = {"all landmarks", "per class"};
+  vector<int> found[2];
+  for (int by_class = 0; by_class < 2; ++by_class) {
+    found[by_class].resize(num_queries);
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < num_queries; ++i) {
+      LandmarkObs obs = queries[i];
+      obs.class_i = by_class ? queries[i].class_i : 0;
+      found[by_class][i] = pf.dataAssociation(obs, map);
+    }
+    double seconds = secondsSince(start);
+    std::cout << names[by_class] << ": " << seconds / num_queries * 1e9
+              << " ns/query" << std::endl;
+  }
+
+  int wrong_class = 0;
+  for (int i = 0; i < num_queries; ++i) {
+    if (map.landmark_list[found[0][i]].class_i != queries[i].class_i) {
+      ++wrong_class;
+    }
+  }
+  std::cout << "class-blind association picked another class for "
+            << 100.0 * wrong_class / num_queries << "% of " << num_queries
+            << " observations (" << num_classes << " classes, extent "
+            << extent << " m)" << std::endl;
+  return 0;
+}
+
+/**
+ * Build time, footprint and association speed of the nearest-landmark
+ *   raster against the index alone, and a check of its answers.
+ *   Arguments: [landmarks=10000] [resolution_cm=50] [queries=1000000]
+ */
+int benchNearestRaster(int argc, char *argv[]) {
+  int num_landmarks = intArg(argc, argv, 2, 10000);
+  double resolution = intArg(argc, argv, 3, 50) / 100.0;
+  int num_queries = intArg(argc, argv, 4, 1000000);
+  double extent = 50.0 * sqrt(static_cast<double>(num_landmarks));
+
+  Map map;
+  makeRandomMap(num_landmarks, 1, map);
+  map.reorderLandmarks();
+  map.buildIndex();
+
+  Clock::time_point start = Clock::now();
+  map.buildRaster(resolution, 50);
+  double build = secondsSince(start);
+  std::cout << "raster " << map.raster.cellCount() << " cells of " << resolution
+            << " m: built in " << build << " s, "
+            << map.raster.memoryBytes() / 1048576.0 << " MiB, "
+            << 100.0 * map.raster.ambiguousCells() / map.raster.cellCount()
+            << "% ambiguous" << std::endl;
+
+  vector<double> qx, qy;
+  trackQueries(num_queries, extent, qx, qy);
+  Map index_map = map;
+  index_map.raster.clear();
+  long long misses;
+  double with_index = timeQueries(index_map, qx, qy, misses);
+  double with_raster = timeQueries(map, qx, qy, misses);
+  std::cout << "index: " << with_index * 1e9 << " ns/query, raster: "
+            << with_raster * 1e9 << " ns/query" << std::endl;
+
+  // Both must find a landmark at the same distance
+  ParticleFilter pf;
+  int mismatches = 0;
+  for (size_t i = 0; i < qx.size(); ++i) {
+    LandmarkObs obs = {0, qx[i], qy[i], 0};
+    double ix, iy, rx, ry;
+    index_map.landmarkPosition(pf.dataAssociation(obs, index_map), ix, iy);
+    map.landmarkPosition(pf.dataAssociation(obs, map), rx, ry);
+    if (fabs(dist(qx[i], qy[i], ix, iy) - dist(qx[i], qy[i], rx, ry)) > 1e-3) {
+      ++mismatches;
+    }
+  }
+  std::cout << mismatches << " mismatches over " << qx.size() << " queries"
+            << std::endl;
+  return 0;
+}
+
+/**
+ * Brute-force association of many queries: the per-query scan of
+ *   dataAssociation against the cache-blocked scan over a sweep of tile
+ *   sizes.
+ *   Arguments: [landmarks=20000] [queries=20000]
+ */
+int benchBlockedScan(int argc, char *argv[]) {
+  int num_landmarks = intArg(argc, argv, 2, 20000);
+  int num_queries = intArg(argc, argv, 3, 20000);
+  double extent = 50.0 * sqrt(static_cast<double>(num_landmarks));
+
+  Map map;
+  makeRandomMap(num_landmarks, 1, map);
+  vector<double> qx, qy;
+  trackQueries(num_queries, extent, qx, qy);
+
+  long long misses;
+  double plain = timeQueries(map, qx, qy, misses);
+  std::cout << "dataAssociation scan: " << plain * 1e6 << " us/query" << std::endl;
+
+  LandmarkColumns columns;
+  columns.assign(map.landmark_list);
+  vector<int> reference(num_queries), nearest(num_queries);
+  nearestLandmarksBlocked(columns, qx.data(), qy.data(), num_queries,
+                          reference.data(), 1, num_landmarks);
+  const int tiles[] = {1, 16, 64, 256, 1024, 4096, 16384};
+  const int num_tiles = sizeof(tiles) / sizeof(tiles[0]);
+  std::cout << "us/query by query tile (rows) and landmark tile (columns)\n     ";
+  for (int l = 0; l < num_tiles; ++l) {
+    std::cout << "\t" << tiles[l];
+  }
+  std::cout << std::endl;
+  for (int q = 0; q < num_tiles; ++q) {
+    std::cout << tiles[q];
+    for (int l = 0; l < num_tiles; ++l) {
+      Clock::time_point start = Clock::now();
+      nearestLandmarksBlocked(columns, qx.data(), qy.data(), num_queries,
+                              nearest.data(), tiles[q], tiles[l]);
+      double seconds = secondsSince(start);
+      std::cout << "\t" << seconds / num_queries * 1e6;
+      if (nearest != reference) {
+        std::cout << "!";
+      }
+    }
+    std::cout << std::endl;
+  }
+  return 0;
+}
+
+/**
+ * Time of updateWeights in particle-major and observation-major loop
+ *   order over particle and observation counts, with the order the
+ *   automatic choice picks, and the largest relative weight difference.
+ *   Arguments: [landmarks=10000] [repeats=5]
+ */
+int benchUpdateOrder(int argc, char *argv[]) {
+  int num_landmarks = intArg(argc, argv, 2, 10000);
+  int repeats = intArg(argc, argv, 3, 5);
+  double extent = 50.0 * sqrt(static_cast<double>(num_landmarks));
+
+  Map map;
+  makeRandomMap(num_landmarks, 1, map);
+  map.reorderLandmarks();
+  map.buildIndex();
+
+  vector<std::pair<double, int> > nearby;
+  for (size_t i = 0; i < map.landmark_list.size(); ++i) {
+    double d = dist(map.landmark_list[i].x_f, map.landmark_list[i].y_f, extent / 2, extent / 2);
+    if (d < 150) {
+      nearby.push_back(std::make_pair(d, static_cast<int>(i)));
+    }
+  }
+  std::sort(nearby.begin(), nearby.end());
+
+  std::mt19937 gen(3);
+  std::normal_distribution<double> noise(0, 0.1);
+  double sigma_pos[3] = {0.3, 0.3, 0.01};
+  double sigma_landmark[2] = {0.3, 0.3};
+  const int particle_counts[] = {8, 32, 100, 1000, 10000};
+  const int observation_counts[] = {1, 2, 5, 10, 20};
+  std::cout << "particles\tobservations\tparticle-major [us]\t"
+            << "observation-major [us]\tauto\tmax weight difference" << std::endl;
+  for (int num_particles : particle_counts) {
+    for (int num_observations : observation_counts) {
+      // Observations of the landmarks closest to the middle of the map,
+      //   seen from there with a heading of 0
+      vector<LandmarkObs> observations;
+      for (size_t i = 0; i < nearby.size() && observations.size() < static_cast<size_t>(num_observations); ++i) {
+        const Map::single_landmark_s &landmark = map.landmark_list[nearby[i].second];
+        LandmarkObs obs = {0, 0, 0, 0};
+        obs.x = landmark.x_f - extent / 2 + noise(gen);
+        obs.y = landmark.y_f - extent / 2 + noise(gen);
+        observations.push_back(obs);
+      }
+
+      double seconds[2];
+      vector<double> weights[2];
+      const ParticleFilter::UpdateOrder orders[] = {ParticleFilter::kParticleMajor,
+                                                    ParticleFilter::kObservationMajor};
+      for (int k = 0; k < 2; ++k) {
+        ParticleFilter pf(num_particles);
+        pf.init(extent / 2, extent / 2, 0, sigma_pos);
+        pf.setUpdateOrder(orders[k]);
+        Clock::time_point start = Clock::now();
+        for (int r = 0; r < repeats; ++r) {
+          pf.updateWeights(50, sigma_landmark, observations, map);
+        }
+        seconds[k] = secondsSince(start) / repeats;
+        for (size_t i = 0; i < pf.particles.size(); ++i) {
+          weights[k].push_back(pf.particles[i].weight);
+        }
+      }
+
+      double max_diff = 0;
+      for (size_t i = 0; i < weights[0].size(); ++i) {
+        double scale = std::max(weights[0][i], weights[1][i]);
+        if (scale > 0) {
+          max_diff = std::max(max_diff, fabs(weights[0][i] - weights[1][i]) / scale);
+        }
+      }
+      bool by_observation = static_cast<size_t>(num_particles) >= kLaneBlockMin
+                            && static_cast<size_t>(num_observations) >= kLaneObservationsMin;
+      std::cout << num_particles << "\t" << num_observations << "\t"
+                << seconds[0] * 1e6 << "\t" << seconds[1] * 1e6 << "\t"
+                << (by_observation ? "observation" : "particle") << "\t"
+                << max_diff << std::endl;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Time from startup to the first filter step, to the first estimate
+ *   using the map and to the first step on the indexed map, when the map
+ *   is loaded on the filter thread and when it is loaded in the
+ *   background with the unindexed map published first. The filter steps
+ *   at the telemetry rate meanwhile, predicting only until a map is
+ *   published.
+ *   Arguments: [landmarks=1000000] [particles=100] [period_ms=100]
+ */
+int benchAsyncStartup(int argc, char *argv[]) {
+  int num_landmarks = intArg(argc, argv, 2, 1000000);
+  int num_particles = intArg(argc, argv, 3, 100);
+  int period_ms = intArg(argc, argv, 4, 100);
+  double extent = 50.0 * sqrt(static_cast<double>(num_landmarks));
+
+  Map source;
+  makeRandomMap(num_landmarks, 1, source);
+  string map_file = "/tmp/pf_bench_map.txt";
+  {
+    std::ofstream out(map_file.c_str());
+    out.precision(10);
+    for (size_t i = 0; i < source.landmark_list.size(); ++i) {
+      out << source.landmark_list[i].x_f << "\t" << source.landmark_list[i].y_f
+          << "\t" << source.landmark_list[i].id_i << "\n";
+    }
+  }
+  vector<LandmarkObs> observations(5);
+  for (size_t o = 0; o < observations.size(); ++o) {
+    LandmarkObs obs = {0, 10.0 * o, 5.0, 0};
+    observations[o] = obs;
+  }
+  double sigma_pos[3] = {0.3, 0.3, 0.01};
+  double sigma_landmark[2] = {0.3, 0.3};
+
+  const char *names[] = {"blocking load", "background load"};
+  for (int background = 0; background < 2; ++background) {
+    Clock::time_point startup = Clock::now();
+    MapStore maps;
+    if (background) {
+      maps.reloadAsync(map_file, num_landmarks);
+    } else {
+      maps.load(map_file);
+    }
+    ParticleFilter pf(num_particles);
+    pf.init(extent / 2, extent / 2, 0, sigma_pos);
+    double first_step = -1, first_estimate = -1, first_indexed = -1;
+    int predict_only = 0, steps = 0;
+    while (first_indexed < 0) {
+      Clock::time_point step_start = Clock::now();
+      std::shared_ptr<const Map> map = maps.current();
+      pf.prediction(0.1, sigma_pos, 1, 0);
+      ++steps;
+      if (map) {
+        pf.updateWeights(50, sigma_landmark, observations, *map);
+        pf.resample();
+        if (first_estimate < 0) {
+          first_estimate = secondsSince(startup);
+        }
+        if (!map->index.empty()) {
+          first_indexed = secondsSince(startup);
+        }
+      } else {
+        ++predict_only;
+      }
+      if (first_step < 0) {
+        first_step = secondsSince(startup);
+      }
+      map.reset();
+      std::this_thread::sleep_until(step_start + std::chrono::milliseconds(period_ms));
+    }
+    std::cout << names[background] << ": first step " << first_step
+              << " s, first estimate " << first_estimate
+              << " s, first indexed step " << first_indexed << " s, "
+              << predict_only << " of " << steps << " steps predicted only"
+              << std::endl;
+  }
+  remove(map_file.c_str());
+  return 0;
+}
+
+/**
+ * Index build time against thread count, and the time to save the index
+ *   and read it back instead.
+ *   Arguments: [landmarks=10000000] [max_threads=hardware threads]
+ */
+int benchIndexBuild(int argc, char *argv[]) {
+  int num_landmarks = intArg(argc, argv, 2, 10000000);
+  int max_threads = intArg(argc, argv, 3, std::max(1u, std::thread::hardware_concurrency()));
+
+  Map map;
+  makeRandomMap(num_landmarks, 1, map);
+  map.reorderLandmarks();
+  for (int threads = 1; threads <= max_threads; threads *= 2) {
+    Clock::time_point start = Clock::now();
+    map.buildIndex(threads);
+    std::cout << threads << " threads: built in " << secondsSince(start) << " s"
+              << std::endl;
+  }
+
+  string index_file = "/tmp/pf_bench_map.idx";
+  Clock::time_point start = Clock::now();
+  MapStore::saveIndex(map, index_file);
+  double saved = secondsSince(start);
+  Map loaded = map;
+  loaded.index = LandmarkIndex();
+  start = Clock::now();
+  bool ok = MapStore::loadIndex(loaded, index_file);
+  double read = secondsSince(start);
+  remove(index_file.c_str());
+
+  // The loaded index must answer like the built one
+  vector<double> qx, qy;
+  uniformQueries(100000, 50.0 * sqrt(static_cast<double>(num_landmarks)), qx, qy);
+  int mismatches = 0;
+  for (size_t i = 0; i < qx.size(); ++i) {
+    mismatches += map.index.nearest(qx[i], qy[i]) != loaded.index.nearest(qx[i], qy[i]);
+  }
+  std::cout << "saved in " << saved << " s, read back in " << read << " s ("
+            << (ok ? "ok" : "failed") << ", " << mismatches << " mismatches)"
+            << std::endl;
+  return 0;
+}
+
+// Simulated drive: the vehicle circles the middle of a random map as
+//   dense as map_data.txt (one landmark per 32 m square), with noisy
+//   observations of the landmarks in range, and is displaced once
+//   (kidnapped) halfway
+struct SimulatedDrive {
+  Map map;
+  double delta_t, sensor_range, velocity, yaw_rate;
+  double sigma_pos[3];
+  double sigma_landmark[2];
+  vector<double> true_x, true_y, true_theta;
+  vector<vector<LandmarkObs> > observations;
+};
+
+void simulateDrive(int num_steps, double kidnap, SimulatedDrive &drive) {
+  int num_landmarks = 1000;
+  double extent = 32.0 * sqrt(static_cast<double>(num_landmarks));
+  makeRandomMap(num_landmarks, 1, drive.map);
+  for (size_t i = 0; i < drive.map.landmark_list.size(); ++i) {
+    drive.map.landmark_list[i].x_f *= 32.0f / 50;
+    drive.map.landmark_list[i].y_f *= 32.0f / 50;
+  }
+  drive.map.reorderLandmarks();
+  drive.map.buildIndex();
+
+  drive.delta_t = 0.1;
+  drive.sensor_range = 50;
+  drive.velocity = 10;
+  drive.yaw_rate = 0.05;
+  drive.sigma_pos[0] = drive.sigma_pos[1] = 0.3;
+  drive.sigma_pos[2] = 0.01;
+  drive.sigma_landmark[0] = drive.sigma_landmark[1] = 0.3;
+
+  std::mt19937 gen(5);
+  std::normal_distribution<double> noise(0, drive.sigma_landmark[0]);
+  drive.true_x.resize(num_steps);
+  drive.true_y.resize(num_steps);
+  drive.true_theta.resize(num_steps);
+  drive.observations.assign(num_steps, vector<LandmarkObs>());
+  double v = drive.velocity, w = drive.yaw_rate;
+  double x = extent / 2, y = extent / 2 - v / w, theta = 0;
+  for (int step = 0; step < num_steps; ++step) {
+    if (step > 0) {
+      double theta_next = theta + w * drive.delta_t;
+      x += v * (sin(theta_next) - sin(theta)) / w;
+      y += v * (cos(theta) - cos(theta_next)) / w;
+      theta = theta_next;
+    }
+    if (step == num_steps / 2) {
+      x += kidnap;
+      y -= kidnap;
+    }
+    drive.true_x[step] = x;
+    drive.true_y[step] = y;
+    drive.true_theta[step] = theta;
+    const vector<Map::single_landmark_s> &landmarks = drive.map.landmark_list;
+    for (size_t i = 0; i < landmarks.size(); ++i) {
+      double dx = landmarks[i].x_f - x, dy = landmarks[i].y_f - y;
+      if (dx * dx + dy * dy < drive.sensor_range * drive.sensor_range) {
+        LandmarkObs obs = {0, 0, 0, 0};
+        obs.x = cos(theta) * dx + sin(theta) * dy + noise(gen);
+        obs.y = -sin(theta) * dx + cos(theta) * dy + noise(gen);
+        drive.observations[step].push_back(obs);
+      }
+    }
+  }
+}
+
+// Runs one filter step of a simulated drive
+void driveStep(const SimulatedDrive &drive, int step, ParticleFilter &pf) {
+  double sigma_pos[3] = {drive.sigma_pos[0], drive.sigma_pos[1], drive.sigma_pos[2]};
+  double sigma_landmark[2] = {drive.sigma_landmark[0], drive.sigma_landmark[1]};
+  if (step == 0) {
+    pf.init(drive.true_x[0], drive.true_y[0], drive.true_theta[0], sigma_pos);
+  } else {
+    pf.prediction(drive.delta_t, sigma_pos, drive.velocity, drive.yaw_rate);
+  }
+  pf.updateWeights(drive.sensor_range, sigma_landmark, drive.observations[step], drive.map);
+  pf.resample();
+}
+
+/**
+ * Replay of a simulated drive through a full particle filter and a hybrid
+ *   one. Reports the time spent in the filter, the share of updates run
+ *   collapsed and the position error of both.
+ *   Arguments: [particles=1000] [steps=2000] [kidnap_m=3]
+ */
+int benchHybridReplay(int argc, char *argv[]) {
+  int num_particles = intArg(argc, argv, 2, 1000);
+  int num_steps = intArg(argc, argv, 3, 2000);
+  double kidnap = intArg(argc, argv, 4, 3);
+  SimulatedDrive drive;
+  simulateDrive(num_steps, kidnap, drive);
+
+  std::cout << "filter\tCPU [ms]\tcollapsed updates [%]\tswitches\t"
+            << "RMS error [m]\terror after kidnap [m]" << std::endl;
+  double cpu[2];
+  for (int hybrid = 0; hybrid < 2; ++hybrid) {
+    ParticleFilter pf(num_particles);
+    pf.setHybrid(hybrid == 1);
+    double sum_err2 = 0, kidnap_err = 0;
+    std::clock_t start = std::clock();
+    for (int step = 0; step < num_steps; ++step) {
+      driveStep(drive, step, pf);
+      PoseEstimate estimate = pf.latestEstimate();
+      double err = dist(estimate.x, estimate.y, drive.true_x[step], drive.true_y[step]);
+      sum_err2 += err * err;
+      if (step == num_steps / 2 + 20) {
+        kidnap_err = err;
+      }
+    }
+    cpu[hybrid] = 1e3 * (std::clock() - start) / CLOCKS_PER_SEC;
+    const FilterStats &stats = pf.stats();
+    int updates = stats.kalman_updates + stats.particle_updates;
+    std::cout << (hybrid ? "hybrid" : "particles") << "\t" << cpu[hybrid] << "\t"
+              << 100.0 * stats.kalman_updates / std::max(updates, 1) << "\t"
+              << stats.mode_switches << "\t" << sqrt(sum_err2 / num_steps) << "\t"
+              << kidnap_err << std::endl;
+  }
+  std::cout << "CPU saved: " << 100 * (1 - cpu[1] / cpu[0]) << "%" << std::endl;
+  return 0;
+}
+
+/**
+ * Replay of a simulated drive at several particle counts, scoring the
+ *   best particle (what the simulator is sent) against refinePose started
+ *   from the best particle, and from the weighted mean with the covariance
+ *   of the cloud as a prior. Reports how few particles the refined pose
+ *   needs to match the best particle of the largest filter.
+ *   Arguments: [steps=1000] [max_particles=1000]
+ */
+int benchRefineReplay(int argc, char *argv[]) {
+  int num_steps = intArg(argc, argv, 2, 1000);
+  int max_particles = intArg(argc, argv, 3, 1000);
+  SimulatedDrive drive;
+  simulateDrive(num_steps, 0, drive);
+
+  std::cout << "particles\tfilter CPU [ms/step]\tbest particle RMS [m]\t"
+            << "refined best RMS [m]\trefined mean RMS [m]\t"
+            << "refine CPU [ms/step]" << std::endl;
+  vector<int> counts;
+  for (int n = 10; n < max_particles; n *= 2) {
+    counts.push_back(n);
+  }
+  counts.push_back(max_particles);
+  vector<double> best_rms, refined_rms;
+  for (int num_particles : counts) {
+    ParticleFilter pf(num_particles);
+    double sum_best = 0, sum_refined = 0, sum_mean = 0;
+    double filter_cpu = 0, refine_cpu = 0;
+    for (int step = 0; step < num_steps; ++step) {
+      std::clock_t start = std::clock();
+      driveStep(drive, step, pf);
+      filter_cpu += std::clock() - start;
+      double true_x = drive.true_x[step] - pf.originX();
+      double true_y = drive.true_y[step] - pf.originY();
+
+      const Particle *best = &pf.particles[0];
+      for (size_t i = 1; i < pf.particles.size(); ++i) {
+        if (pf.particles[i].weight > best->weight) {
+          best = &pf.particles[i];
+        }
+      }
+      double err = dist(best->x, best->y, true_x, true_y);
+      sum_best += err * err;
+
+      double x = best->x, y = best->y, theta = best->theta;
+      pf.refinePose(x, y, theta, drive.sigma_landmark, drive.observations[step], drive.map);
+      err = dist(x, y, true_x, true_y);
+      sum_refined += err * err;
+
+      start = std::clock();
+      PoseEstimate estimate = pf.latestEstimate();
+      x = estimate.x - pf.originX();
+      y = estimate.y - pf.originY();
+      theta = estimate.theta;
+      pf.refinePose(x, y, theta, drive.sigma_landmark, drive.observations[step],
+                    drive.map, estimate.cov);
+      refine_cpu += std::clock() - start;
+      err = dist(x, y, true_x, true_y);
+      sum_mean += err * err;
+    }
+    best_rms.push_back(sqrt(sum_best / num_steps));
+    refined_rms.push_back(sqrt(sum_mean / num_steps));
+    std::cout << num_particles << "\t" << 1e3 * filter_cpu / CLOCKS_PER_SEC / num_steps
+              << "\t" << best_rms.back() << "\t" << sqrt(sum_refined / num_steps)
+              << "\t" << refined_rms.back() << "\t"
+              << 1e3 * refine_cpu / CLOCKS_PER_SEC / num_steps << std::endl;
+  }
+
+  for (size_t k = 0; k < counts.size(); ++k) {
+    if (refined_rms[k] <= best_rms.back()) {
+      std::cout << "refined mean of " << counts[k] << " particles matches the best "
+                << "particle of " << counts.back() << " ("
+                << static_cast<double>(counts.back()) / counts[k] << "x fewer)"
+                << std::endl;
+      break;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Replay of a simulated drive with a large kidnapping through plain and
+ *   augmented (particle injecting) filters. Reports the CPU time, the
+ *   error before the kidnapping and how long each filter takes to find
+ *   the vehicle again.
+ *   Arguments: [small_particles=100] [large_particles=2000] [steps=2000]
+ *   [kidnap_m=50]
+ */
+int benchKidnapReplay(int argc, char *argv[]) {
+  int small_particles = intArg(argc, argv, 2, 100);
+  int large_particles = intArg(argc, argv, 3, 2000);
+  int num_steps = intArg(argc, argv, 4, 2000);
+  double kidnap = intArg(argc, argv, 5, 50);
+  SimulatedDrive drive;
+  simulateDrive(num_steps, kidnap, drive);
+  int kidnap_step = num_steps / 2;
+
+  std::cout << "filter\tparticles\tCPU [ms]\tRMS error before [m]\t"
+            << "recovered after [s]\tinjected" << std::endl;
+  const int counts[] = {small_particles, large_particles, small_particles};
+  for (int run = 0; run < 3; ++run) {
+    ParticleFilter pf(counts[run]);
+    pf.setAugmented(run == 2);
+    double sum_err2 = 0;
+    int injected = 0, recovered = -1;
+    vector<double> errors(num_steps);
+    std::clock_t start = std::clock();
+    for (int step = 0; step < num_steps; ++step) {
+      driveStep(drive, step, pf);
+      injected += pf.stats().injected;
+      PoseEstimate estimate = pf.latestEstimate();
+      errors[step] = dist(estimate.x, estimate.y, drive.true_x[step], drive.true_y[step]);
+      if (step < kidnap_step) {
+        sum_err2 += errors[step] * errors[step];
+      }
+    }
+    double cpu = 1e3 * (std::clock() - start) / CLOCKS_PER_SEC;
+
+    // Recovered once the error stays under 1 m for the rest of the drive
+    for (int step = num_steps - 1; step >= kidnap_step && errors[step] < 1; --step) {
+      recovered = step;
+    }
+    std::cout << (run == 2 ? "augmented" : "plain") << "\t" << counts[run] << "\t"
+              << cpu << "\t" << sqrt(sum_err2 / kidnap_step) << "\t";
+    if (recovered >= 0) {
+      std::cout << (recovered - kidnap_step) * drive.delta_t;
+    } else {
+      std::cout << "never";
+    }
+    std::cout << "\t" << injected << std::endl;
+  }
+  return 0;
+}
+
+/**
+ * Replay of a simulated drive at several particle counts through filters
+ *   moving the particles with the motion model and with the optimal
+ *   proposal. Reports the position error of the weighted mean, the CPU
+ *   per step and per particle, and how few particles the optimal
+ *   proposal needs to come within 2% of the error of the motion model
+ *   with the most particles.
+ *   Arguments: [steps=1000] [max_particles=1000]
+ */
+int benchProposalReplay(int argc, char *argv[]) {
+  int num_steps = intArg(argc, argv, 2, 1000);
+  int max_particles = intArg(argc, argv, 3, 1000);
+  SimulatedDrive drive;
+  simulateDrive(num_steps, 0, drive);
+
+  std::cout << "proposal\tparticles\tRMS error [m]\tCPU [ms/step]\t"
+            << "CPU [us/particle/step]" << std::endl;
+  vector<int> counts;
+  for (int n = 10; n < max_particles; n *= 2) {
+    counts.push_back(n);
+  }
+  counts.push_back(max_particles);
+  vector<double> rms[2], cost[2];
+  for (int optimal = 0; optimal < 2; ++optimal) {
+    for (int num_particles : counts) {
+      ParticleFilter pf(num_particles);
+      pf.setProposal(optimal ? ParticleFilter::kProposalOptimal
+                             : ParticleFilter::kProposalMotion);
+      double sum_err2 = 0;
+      std::clock_t start = std::clock();
+      for (int step = 0; step < num_steps; ++step) {
+        driveStep(drive, step, pf);
+        PoseEstimate estimate = pf.latestEstimate();
+        double err = dist(estimate.x, estimate.y, drive.true_x[step], drive.true_y[step]);
+        sum_err2 += err * err;
+      }
+      double cpu = 1e3 * (std::clock() - start) / CLOCKS_PER_SEC / num_steps;
+      rms[optimal].push_back(sqrt(sum_err2 / num_steps));
+      cost[optimal].push_back(1e3 * cpu / num_particles);
+      std::cout << (optimal ? "optimal" : "motion") << "\t" << num_particles << "\t"
+                << rms[optimal].back() << "\t" << cpu << "\t" << cost[optimal].back()
+                << std::endl;
+    }
+  }
+
+  for (size_t k = 0; k < counts.size(); ++k) {
+    if (rms[1][k] <= 1.02 * rms[0].back()) {
+      std::cout << "optimal proposal with " << counts[k] << " particles matches the "
+                << "motion model with " << counts.back() << " ("
+                << static_cast<double>(counts.back()) / counts[k] << "x fewer particles, "
+                << cost[1][k] / cost[0][k] << "x the CPU per particle)" << std::endl;
+      break;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Replay of a simulated drive at several particle counts through plain
+ *   and regularized filters, the process noise scaled down by a factor
+ *   (as when tuned to a good odometry), which leaves little noise to
+ *   spread the duplicates of a parent. Reports the position error of the
+ *   weighted mean, the share of particles with a parent of their own
+ *   after resampling and the CPU time.
+ *   Arguments: [steps=2000] [max_particles=1000] [noise_percent=5]
+ */
+int benchRegularizedReplay(int argc, char *argv[]) {
+  int num_steps = intArg(argc, argv, 2, 2000);
+  int max_particles = intArg(argc, argv, 3, 1000);
+  double noise_scale = intArg(argc, argv, 4, 5) / 100.0;
+  SimulatedDrive drive;
+  simulateDrive(num_steps, 0, drive);
+  for (int i = 0; i < 3; ++i) {
+    drive.sigma_pos[i] *= noise_scale;
+  }
+
+  std::cout << "filter\tparticles\tRMS error [m]\tunique parents [%]\t"
+            << "CPU [ms/step]" << std::endl;
+  vector<int> counts;
+  for (int n = 10; n < max_particles; n *= 2) {
+    counts.push_back(n);
+  }
+  counts.push_back(max_particles);
+  for (int regularized = 0; regularized < 2; ++regularized) {
+    for (int num_particles : counts) {
+      ParticleFilter pf(num_particles);
+      pf.setRegularized(regularized == 1);
+      double sum_err2 = 0, sum_unique = 0;
+      std::clock_t start = std::clock();
+      for (int step = 0; step < num_steps; ++step) {
+        driveStep(drive, step, pf);
+        PoseEstimate estimate = pf.latestEstimate();
+        double err = dist(estimate.x, estimate.y, drive.true_x[step], drive.true_y[step]);
+        sum_err2 += err * err;
+        sum_unique += pf.stats().unique_ancestors;
+      }
+      double cpu = 1e3 * (std::clock() - start) / CLOCKS_PER_SEC / num_steps;
+      std::cout << (regularized ? "regularized" : "plain") << "\t" << num_particles << "\t"
+                << sqrt(sum_err2 / num_steps) << "\t"
+                << 100 * sum_unique / num_steps / num_particles << "\t" << cpu << std::endl;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Replay of a simulated drive through a filter keeping the ancestors of
+ *   the last steps. Reports, for several lags, the position error of the
+ *   smoothed pose that many steps back against the filtered one, the CPU
+ *   time of tracing the lineage, and the memory of the ring against that
+ *   of copying the particles every step.
+ *   Arguments: [particles=100] [steps=2000] [max_lag=20]
+ */
+int benchSmoothingReplay(int argc, char *argv[]) {
+  int num_particles = intArg(argc, argv, 2, 100);
+  int num_steps = intArg(argc, argv, 3, 2000);
+  int max_lag = intArg(argc, argv, 4, 20);
+  SimulatedDrive drive;
+  simulateDrive(num_steps, 0, drive);
+
+  vector<int> lags;
+  for (int lag = 1; lag < max_lag; lag *= 2) {
+    lags.push_back(lag);
+  }
+  lags.push_back(max_lag);
+
+  ParticleFilter pf(num_particles);
+  pf.enableSmoothing(max_lag);
+  vector<double> filtered(num_steps);
+  vector<double> sum_err2(lags.size(), 0);
+  double sum_filtered2 = 0;
+  int smoothed_steps = 0;
+  double trace_cpu = 0;
+  vector<PoseEstimate> trajectory;
+  for (int step = 0; step < num_steps; ++step) {
+    driveStep(drive, step, pf);
+    PoseEstimate estimate = pf.latestEstimate();
+    filtered[step] = dist(estimate.x, estimate.y, drive.true_x[step], drive.true_y[step]);
+
+    std::clock_t start = std::clock();
+    bool smoothed = pf.smoothedTrajectory(max_lag, trajectory);
+    trace_cpu += std::clock() - start;
+    if (!smoothed) {
+      continue;
+    }
+    int past = step - max_lag;
+    sum_filtered2 += filtered[past] * filtered[past];
+    for (size_t k = 0; k < lags.size(); ++k) {
+      int lag = lags[k];
+      const PoseEstimate &pose = trajectory[max_lag - lag];
+      double err = dist(pose.x, pose.y, drive.true_x[step - lag], drive.true_y[step - lag]);
+      sum_err2[k] += err * err;
+    }
+    ++smoothed_steps;
+  }
+
+  // The lagged errors are over the same steps, shifted by the lag, so
+  //   compare them with the filtered error over all steps as well
+  double sum_all2 = 0;
+  for (int step = 0; step < num_steps; ++step) {
+    sum_all2 += filtered[step] * filtered[step];
+  }
+  std::cout << "filtered RMS error [m]\t" << sqrt(sum_all2 / num_steps) << std::endl;
+  std::cout << "lag [steps]\tsmoothed RMS error [m]" << std::endl;
+  for (size_t k = 0; k < lags.size(); ++k) {
+    std::cout << lags[k] << "\t" << sqrt(sum_err2[k] / std::max(smoothed_steps, 1))
+              << std::endl;
+  }
+  size_t ring_bytes = (max_lag + 1) * num_particles * (3 * sizeof(double) + sizeof(int));
+  size_t copy_bytes = (max_lag + 1) * num_particles * sizeof(Particle);
+  std::cout << "trace CPU [us/call]\t"
+            << 1e6 * trace_cpu / CLOCKS_PER_SEC / std::max(smoothed_steps, 1) << std::endl;
+  std::cout << "ring [kB]\t" << ring_bytes / 1024.0 << "\tcopied particles [kB]\t"
+            << copy_bytes / 1024.0 << " (without their association vectors)" << std::endl;
+  return 0;
+}
+
+// True pose of a simulated drive at filter time t, the vehicle moved on
+//   from the step before with its constant controls
+void truePoseAt(const SimulatedDrive &drive, double t, double &x, double &y) {
+  int step = std::min(static_cast<int>(t / drive.delta_t),
+                      static_cast<int>(drive.true_x.size()) - 1);
+  double dt = t - step * drive.delta_t;
+  double theta = drive.true_theta[step];
+  double v = drive.velocity, w = drive.yaw_rate;
+  x = drive.true_x[step] + v / w * (sin(theta + w * dt) - sin(theta));
+  y = drive.true_y[step] + v / w * (cos(theta) - cos(theta + w * dt));
+}
+
+/**
+ * Replay of a simulated drive with poses queried between the filter
+ *   steps, as by a consumer at another rate. Reports the position error
+ *   of poseAt against holding the last estimate, for queries between
+ *   past estimates and ahead of the newest one, and the rate and failures
+ *   of a thread querying concurrently with the filter. The replay runs
+ *   far faster than real time, so a query preempted for a few ms can
+ *   find its time already gone from the ring and fail.
+ *   Arguments: [particles=100] [steps=2000]
+ */
+int benchPoseQuery(int argc, char *argv[]) {
+  int num_particles = intArg(argc, argv, 2, 100);
+  int num_steps = intArg(argc, argv, 3, 2000);
+  SimulatedDrive drive;
+  simulateDrive(num_steps, 0, drive);
+
+  // Offsets [s] of the queries from the time of the newest estimate
+  const double offsets[] = {-1.23, -0.45, -0.05, 0.03, 0.07, 0.2};
+  const int num_offsets = sizeof(offsets) / sizeof(offsets[0]);
+  vector<double> query_err2(num_offsets, 0), hold_err2(num_offsets, 0);
+  vector<int> answered(num_offsets, 0);
+
+  ParticleFilter pf(num_particles);
+  std::atomic<bool> done(false);
+  std::atomic<long> queries(0), failures(0);
+  std::thread consumer([&] {
+    PoseEstimate pose;
+    while (!done.load(std::memory_order_relaxed)) {
+      // Ask 0.15 s back, once the filter has covered that far
+      double stamp = pf.latestEstimate().stamp - 0.15;
+      if (stamp < 0) {
+        continue;
+      }
+      if (!pf.poseAt(stamp, pose)) {
+        failures.fetch_add(1, std::memory_order_relaxed);
+      }
+      queries.fetch_add(1, std::memory_order_relaxed);
+    }
+  });
+  Clock::time_point start = Clock::now();
+  for (int step = 0; step < num_steps; ++step) {
+    driveStep(drive, step, pf);
+    PoseEstimate latest = pf.latestEstimate();
+    for (int k = 0; k < num_offsets; ++k) {
+      double t = latest.stamp + offsets[k];
+      PoseEstimate pose;
+      if (t < 0 || t > (num_steps - 1) * drive.delta_t || !pf.poseAt(t, pose)) {
+        continue;
+      }
+      double true_x, true_y;
+      truePoseAt(drive, t, true_x, true_y);
+      double err = dist(pose.x, pose.y, true_x, true_y);
+      query_err2[k] += err * err;
+      err = dist(latest.x, latest.y, true_x, true_y);
+      hold_err2[k] += err * err;
+      ++answered[k];
+    }
+  }
+  double seconds = secondsSince(start);
+  done = true;
+  consumer.join();
+
+  std::cout << "offset [s]\tposeAt RMS error [m]\tlast estimate RMS error [m]\tanswered"
+            << std::endl;
+  for (int k = 0; k < num_offsets; ++k) {
+    int n = std::max(answered[k], 1);
+    std::cout << offsets[k] << "\t" << sqrt(query_err2[k] / n) << "\t"
+              << sqrt(hold_err2[k] / n) << "\t" << answered[k] << std::endl;
+  }
+  std::cout << "concurrent queries: " << queries.load() / seconds / 1e6 << " M/s, "
+            << failures.load() << " failed of " << queries.load() << std::endl;
+  return 0;
+}
+
+int benchAutotune(int argc, char *argv[]) {
+  if (argc < 4) {
+    std::cerr << "autotune needs a map file and a profile to write" << std::endl;
+    return -1;
+  }
+  int num_particles = intArg(argc, argv, 4, 100);
+
+  Map map;
+  if (!read_map_data(argv[2], map)) {
+    std::cerr << "Could not read " << argv[2] << std::endl;
+    return -1;
+  }
+  map.reorderLandmarks();
+  FilterConfig config = autotune(map, num_particles, &std::cout);
+  if (!saveConfig(config, argv[3])) {
+    std::cerr << "Could not write " << argv[3] << std::endl;
+    return -1;
+  }
+  std::cout << "profile written to " << argv[3] << std::endl;
+  return 0;
+}
+
+struct Benchmark {
+  const char *name;
+  int (*run)(int argc, char *argv[]);
+  const char *help;
+};
+
+const Benchmark kBenchmarks[] = {
+  {"index-update", benchIndexUpdate, "[landmarks] [edits]"},
+  {"compact-map", benchCompactMap, "[landmarks] [queries]"},
+  {"landmark-order", benchLandmarkOrder, "[landmarks] [queries]"},
+  {"resample-sort", benchResampleSort, "[particles] [landmarks] [steps]"},
+  {"class-index", benchClassIndex, "[landmarks] [classes] [queries]"},
+  {"nearest-raster", benchNearestRaster, "[landmarks] [resolution_cm] [queries]"},
+  {"blocked-scan", benchBlockedScan, "[landmarks] [queries]"},
+  {"update-order", benchUpdateOrder, "[landmarks] [repeats]"},
+  {"async-startup", benchAsyncStartup, "[landmarks] [particles] [period_ms]"},
+  {"index-build", benchIndexBuild, "[landmarks] [max_threads]"},
+  {"hybrid-replay", benchHybridReplay, "[particles] [steps] [kidnap_m]"},
+  {"refine-replay", benchRefineReplay, "[steps] [max_particles]"},
+  {"kidnap-replay", benchKidnapReplay, "[small_particles] [large_particles] [steps] [kidnap_m]"},
+  {"proposal-replay", benchProposalReplay, "[steps] [max_particles]"},
+  {"regularized-replay", benchRegularizedReplay, "[steps] [max_particles] [noise_percent]"},
+  {"smoothing-replay", benchSmoothingReplay, "[particles] [steps] [max_lag]"},
+  {"pose-query", benchPoseQuery, "[particles] [steps]"},
+  {"autotune", benchAutotune, "<map_file> <profile> [particles]"},
+};
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  for (size_t i = 0; i < sizeof(kBenchmarks) / sizeof(kBenchmarks[0]); ++i) {
+    if (argc > 1 && strcmp(argv[1], kBenchmarks[i].name) == 0) {
+      return kBenchmarks[i].run(argc, argv);
+    }
+  }
+  std::cerr << "Usage: " << argv[0] << " <benchmark> [arguments]" << std::endl;
+  for (size_t i = 0; i < sizeof(kBenchmarks) / sizeof(kBenchmarks[0]); ++i) {
+    std::cerr << "  " << kBenchmarks[i].name << " " << kBenchmarks[i].help << std::endl;
+  }
+  return -1;
+}
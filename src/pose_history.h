@@ -0,0 +1,169 @@
+/**
+ * pose_history.h
+ * Ring of recently published pose estimates, queried at any time.
+ *
+ * Consumers running at their own rate ask for the pose at their own
+ *   timestamps instead of taking the last estimate. A query between two
+ *   estimates moves both to the requested time with the motion model
+ *   and blends them; a query after the newest one extrapolates it with
+ *   the last control, up to kPoseExtrapolationMax. Every slot is a
+ *   sequence lock and the count of published samples is atomic, so the
+ *   filter never waits for a reader and readers never lock; a reader
+ *   lapped by the writer while walking the ring fails instead of mixing
+ *   samples.
+ */
+
+#ifndef POSE_HISTORY_H_
+#define POSE_HISTORY_H_
+
+#include <math.h>
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+#include "seqlock.h"
+
+/**
+ * Struct holding a published pose estimate: the weighted mean of the
+ *   particles and their covariance.
+ */
+struct PoseEstimate {
+  double x;         // Mean global x position [m]
+  double y;         // Mean global y position [m]
+  double theta;     // Mean yaw [rad]
+  double cov[9];    // Row-major covariance of (x, y, theta)
+  double stamp;     // Filter time of the estimate [s]
+  uint64_t step;    // Number of updates so far
+};
+
+// Estimates kept for queries, 6.4 s at the simulator's 10 Hz
+const int kPoseHistorySize = 64;
+
+// Longest time [s] a query may extrapolate past the newest estimate
+const double kPoseExtrapolationMax = 0.5;
+
+/**
+ * Struct representing one recorded estimate with the control the vehicle
+ *   followed up to it.
+ */
+struct PoseSample {
+  PoseEstimate pose;
+  double velocity;  // Velocity of the last control [m/s]
+  double yawrate;   // Yaw rate of the last control [rad/s]
+  uint64_t index;   // Number of samples pushed before this one
+};
+
+class PoseHistory {
+ public:
+  explicit PoseHistory(int capacity = kPoseHistorySize)
+      : slots(capacity), count(0) {}
+
+  /**
+   * push Records an estimate, overwriting the oldest one when full. Must
+   *   only be called from one thread.
+   */
+  void push(const PoseEstimate &pose, double velocity, double yawrate) {
+    uint64_t n = count.load(std::memory_order_relaxed);
+    PoseSample sample;
+    sample.pose = pose;
+    sample.velocity = velocity;
+    sample.yawrate = yawrate;
+    sample.index = n;
+    slots[n % slots.size()].write(sample);
+    count.store(n + 1, std::memory_order_release);
+  }
+
+  /**
+   * amend Replaces the newest estimate, keeping its control, when a late
+   *   observation corrects it. Must only be called from the thread calling
+   *   push.
+   */
+  void amend(const PoseEstimate &pose) {
+    uint64_t n = count.load(std::memory_order_relaxed);
+    if (n == 0) {
+      return;
+    }
+    SeqLock<PoseSample> &slot = slots[(n - 1) % slots.size()];
+    PoseSample sample = slot.read();
+    sample.pose = pose;
+    slot.write(sample);
+  }
+
+  /**
+   * query Pose at a filter time. Safe from any thread, never blocks.
+   * @param stamp Filter time [s]
+   * @param pose Receives the pose; the covariance is blended like the
+   *   mean, and not grown when extrapolating
+   * @output False if stamp is before the oldest sample or too far past
+   *   the newest one, or the ring wrapped under the query
+   */
+  bool query(double stamp, PoseEstimate &pose) const {
+    uint64_t n = count.load(std::memory_order_acquire);
+    if (n == 0) {
+      return false;
+    }
+    PoseSample newer = slots[(n - 1) % slots.size()].read();
+    if (newer.index != n - 1) {
+      return false;
+    }
+    if (stamp >= newer.pose.stamp) {
+      if (stamp - newer.pose.stamp > kPoseExtrapolationMax) {
+        return false;
+      }
+      pose = newer.pose;
+      move(pose, newer.velocity, newer.yawrate, stamp - newer.pose.stamp);
+      pose.stamp = stamp;
+      return true;
+    }
+
+    // Walk back to the newest sample not after stamp
+    uint64_t oldest = n > slots.size() ? n - slots.size() : 0;
+    for (uint64_t i = n - 1; i-- > oldest;) {
+      PoseSample older = slots[i % slots.size()].read();
+      if (older.index != i) {
+        return false;
+      }
+      if (older.pose.stamp > stamp) {
+        newer = older;
+        continue;
+      }
+
+      // Bring both to stamp with the control followed between them, and
+      //   blend them by their distance in time
+      PoseEstimate from_older = older.pose;
+      PoseEstimate from_newer = newer.pose;
+      move(from_older, newer.velocity, newer.yawrate, stamp - older.pose.stamp);
+      move(from_newer, newer.velocity, newer.yawrate, stamp - newer.pose.stamp);
+      double span = newer.pose.stamp - older.pose.stamp;
+      double s = span > 0 ? (stamp - older.pose.stamp) / span : 1;
+      pose = from_older;
+      pose.x += s * (from_newer.x - from_older.x);
+      pose.y += s * (from_newer.y - from_older.y);
+      pose.theta += s * remainder(from_newer.theta - from_older.theta, 2 * M_PI);
+      for (int k = 0; k < 9; ++k) {
+        pose.cov[k] += s * (from_newer.cov[k] - from_older.cov[k]);
+      }
+      pose.stamp = stamp;
+      return true;
+    }
+    return false;
+  }
+
+ private:
+  // Moves a pose by the CTRV motion model for dt [s], backwards if negative
+  static void move(PoseEstimate &pose, double velocity, double yawrate, double dt) {
+    if (yawrate == 0) {
+      pose.x += velocity * dt * cos(pose.theta);
+      pose.y += velocity * dt * sin(pose.theta);
+    } else {
+      double theta = pose.theta + yawrate * dt;
+      pose.x += velocity / yawrate * (sin(theta) - sin(pose.theta));
+      pose.y += velocity / yawrate * (cos(pose.theta) - cos(theta));
+      pose.theta = theta;
+    }
+  }
+
+  std::vector<SeqLock<PoseSample> > slots;
+  std::atomic<uint64_t> count;  // Samples pushed so far
+};
+
+#endif  // POSE_HISTORY_H_
@@ -0,0 +1,43 @@
+/**
+ * record_reader.cpp
+ * Extracts a range of steps from a particle recording as text.
+ *
+ * Usage: record_reader <recording> [first_step [last_step]]
+ *   Prints one "step" line with the estimate per frame, followed by one
+ *   line per particle: x y theta weight, the weights normalized to sum to 1.
+ */
+
+#include <stdlib.h>
+#include <iostream>
+#include "particle_recorder.h"
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0] << " <recording> [first_step [last_step]]"
+              << std::endl;
+    return -1;
+  }
+  uint32_t first = argc > 2 ? strtoul(argv[2], NULL, 10) : 0;
+  uint32_t last = argc > 3 ? strtoul(argv[3], NULL, 10) : 0xffffffffu;
+
+  RecordReader reader;
+  if (!reader.open(argv[1])) {
+    std::cerr << "Error: Could not open recording " << argv[1] << std::endl;
+    return -1;
+  }
+  if (!reader.seekStep(first)) {
+    return 0;
+  }
+
+  RecordedStep frame;
+  while (reader.next(frame) && frame.step <= last) {
+    std::cout << "step " << frame.step << " " << frame.est_x << " "
+              << frame.est_y << " " << frame.est_theta << " "
+              << frame.x.size() << "\n";
+    for (size_t i = 0; i < frame.x.size(); ++i) {
+      std::cout << frame.x[i] << " " << frame.y[i] << " " << frame.theta[i]
+                << " " << frame.weight[i] << "\n";
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,77 @@
+/**
+ * seqlock.h
+ * Single-writer sequence lock for publishing small trivially copyable
+ *   values to any number of polling readers.
+ *
+ * The writer never waits. Readers retry while a write is in progress,
+ *   so they never block the writer and never see a torn value. The value
+ *   is kept in atomic words, which keeps concurrent copies race free.
+ */
+
+#ifndef SEQLOCK_H_
+#define SEQLOCK_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+
+template <typename T>
+class SeqLock {
+ public:
+  SeqLock() : seq(0) {
+    for (size_t i = 0; i < kWords; ++i) {
+      words[i].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  /**
+   * write Publishes a new value. Must only be called from one thread.
+   */
+  void write(const T &value) {
+    uint64_t buf[kWords] = {};
+    memcpy(buf, &value, sizeof(T));
+
+    uint64_t s = seq.load(std::memory_order_relaxed);
+    seq.store(s + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0; i < kWords; ++i) {
+      words[i].store(buf[i], std::memory_order_relaxed);
+    }
+    seq.store(s + 2, std::memory_order_release);
+  }
+
+  /**
+   * read Returns the last published value. Safe from any thread.
+   */
+  T read() const {
+    uint64_t buf[kWords];
+    uint64_t s1, s2;
+    do {
+      s1 = seq.load(std::memory_order_acquire);
+      for (size_t i = 0; i < kWords; ++i) {
+        buf[i] = words[i].load(std::memory_order_relaxed);
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      s2 = seq.load(std::memory_order_relaxed);
+    } while ((s1 & 1) || s1 != s2);
+
+    T value;
+    memcpy(&value, buf, sizeof(T));
+    return value;
+  }
+
+  /**
+   * version Returns the number of completed writes.
+   */
+  uint64_t version() const {
+    return seq.load(std::memory_order_acquire) / 2;
+  }
+
+ private:
+  static const size_t kWords = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+  std::atomic<uint64_t> seq;  // Odd while a write is in progress
+  std::atomic<uint64_t> words[kWords];
+};
+
+#endif  // SEQLOCK_H_
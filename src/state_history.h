@@ -0,0 +1,93 @@
+/**
+ * state_history.h
+ * Fixed-capacity ring of recent filter steps.
+ *
+ * Each entry keeps the compact predicted state of the particles before
+ *   the update (x, y, theta only), the ancestor indices picked by the
+ *   resample of that step, and the inputs needed to replay the step.
+ *   The states and ancestors alone also give the lines of descent of the
+ *   particles, which the fixed-lag smoother traces back.
+ *   Entry buffers are allocated once and reused as the ring wraps.
+ */
+
+#ifndef STATE_HISTORY_H_
+#define STATE_HISTORY_H_
+
+#include <vector>
+#include "helper_functions.h"
+
+/**
+ * Struct representing one recorded filter step.
+ */
+struct HistoryEntry {
+  double stamp;                           // Filter time of the update [s]
+  double origin_x;                        // Local origin the state is relative to [m]
+  double origin_y;
+  std::vector<double> x;                  // Predicted particle x before the update [m]
+  std::vector<double> y;                  // Predicted particle y before the update [m]
+  std::vector<double> theta;              // Predicted particle yaw before the update [rad]
+  std::vector<int> ancestors;             // Parent of each particle after the resample,
+                                          //   -1 for injected particles
+  std::vector<LandmarkObs> observations;  // Observations used by the update
+  std::vector<control_step_s> controls;   // Controls applied after the resample
+  std::vector<char> noise_after;          // Whether noise was drawn after each control
+};
+
+class StateHistory {
+ public:
+  StateHistory() : head(0), count(0) {}
+
+  /**
+   * reset Drops all entries and sets the capacity of the ring.
+   */
+  void reset(int capacity) {
+    entries.assign(capacity, HistoryEntry());
+    head = 0;
+    count = 0;
+  }
+
+  int capacity() const {
+    return static_cast<int>(entries.size());
+  }
+
+  int size() const {
+    return count;
+  }
+
+  /**
+   * back Returns the entry k steps before the newest one (0 = newest).
+   */
+  HistoryEntry &back(int k) {
+    int n = capacity();
+    return entries[(head + n - 1 - k) % n];
+  }
+
+  const HistoryEntry &back(int k) const {
+    int n = capacity();
+    return entries[(head + n - 1 - k) % n];
+  }
+
+  /**
+   * push Starts a new entry, overwriting the oldest one when full.
+   *   The buffers of the reused entry keep their capacity.
+   */
+  HistoryEntry &push() {
+    HistoryEntry &entry = entries[head];
+    head = (head + 1) % capacity();
+    if (count < capacity()) {
+      ++count;
+    }
+    entry.ancestors.clear();
+    entry.observations.clear();
+    entry.controls.clear();
+    entry.noise_after.clear();
+    return entry;
+  }
+
+ private:
+  std::vector<HistoryEntry> entries;
+  int head;   // Slot the next push writes to
+  int count;  // Number of valid entries
+};
+
+#endif  // STATE_HISTORY_H_
@@ -0,0 +1,77 @@
+/**
+ * worker_pool.cpp
+ */
+
+#include "worker_pool.h"
+
+#include <functional>
+#include <mutex>
+#include <thread>
+
+WorkerPool::WorkerPool(int threads)
+    : task(0), items(0), next_item(0), active(0), batch(0), stopping(false) {
+  for (int worker = 1; worker < threads; ++worker) {
+    workers.push_back(std::thread(&WorkerPool::work, this, worker));
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  start_cv.notify_all();
+  for (size_t i = 0; i < workers.size(); ++i) {
+    workers[i].join();
+  }
+}
+
+void WorkerPool::run(int items, const std::function<void(int, int)> &task) {
+  if (workers.empty() || items <= 1) {
+    for (int item = 0; item < items; ++item) {
+      task(item, 0);
+    }
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    this->task = &task;
+    this->items = items;
+    next_item = 0;
+    active = static_cast<int>(workers.size());
+    ++batch;
+  }
+  start_cv.notify_all();
+  drain(0);
+
+  std::unique_lock<std::mutex> lock(mutex);
+  done_cv.wait(lock, [this] { return active == 0; });
+  this->task = 0;
+}
+
+void WorkerPool::work(int worker) {
+  uint64_t seen = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      start_cv.wait(lock, [this, seen] { return stopping || batch != seen; });
+      if (stopping) {
+        return;
+      }
+      seen = batch;
+    }
+    drain(worker);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      --active;
+    }
+    done_cv.notify_one();
+  }
+}
+
+void WorkerPool::drain(int worker) {
+  for (int item = next_item++; item < items; item = next_item++) {
+    (*task)(item, worker);
+  }
+}
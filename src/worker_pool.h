@@ -0,0 +1,63 @@
+/**
+ * worker_pool.h
+ * Fixed set of threads running batches of independent work items.
+ *
+ * The calling thread takes part in every batch, so a pool of n threads
+ *   starts n - 1 workers. Items are handed out one at a time from a shared
+ *   counter, which balances uneven items without a queue.
+ */
+
+#ifndef WORKER_POOL_H_
+#define WORKER_POOL_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class WorkerPool {
+ public:
+  /**
+   * Constructor
+   * @param threads Threads working on a batch, the caller included
+   */
+  explicit WorkerPool(int threads);
+
+  // Stops and joins the workers
+  ~WorkerPool();
+
+  int threads() const {
+    return static_cast<int>(workers.size()) + 1;
+  }
+
+  /**
+   * run Calls task(item, worker) for every item in [0, items) and waits
+   *   until all calls returned. worker is in [0, threads()), 0 being the
+   *   calling thread, and tells which per-thread scratch a call may use.
+   */
+  void run(int items, const std::function<void(int, int)> &task);
+
+ private:
+  // Worker thread loop, waits for batches and works on them
+  void work(int worker);
+
+  // Takes items of the current batch until there are none left
+  void drain(int worker);
+
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable start_cv;
+  std::condition_variable done_cv;
+
+  const std::function<void(int, int)> *task;  // Task of the current batch
+  int items;                                  // Items in the current batch
+  std::atomic<int> next_item;                 // Next item to hand out
+  int active;                                 // Workers still on the batch
+  uint64_t batch;                             // Number of batches started
+  bool stopping;
+};
+
+#endif  // WORKER_POOL_H_